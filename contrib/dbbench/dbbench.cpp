@@ -0,0 +1,203 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Replay a log written by bitcoind -dbreplaylog into a new LevelDB database
+// with the given options, and report how long the writes, reads and seeks took.
+// See README.
+
+#include <leveldb/cache.h>
+#include <leveldb/db.h>
+#include <leveldb/env.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+static double GetTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static bool ReadSize(FILE *file, unsigned int &nSize)
+{
+    unsigned char pchSize[4];
+    if (fread(pchSize, 1, 4, file) != 4)
+        return false;
+    nSize = pchSize[0] | (pchSize[1] << 8) | (pchSize[2] << 16) | ((unsigned int)pchSize[3] << 24);
+    return true;
+}
+
+static bool ReadSlice(FILE *file, std::string &str)
+{
+    unsigned int nSize;
+    if (!ReadSize(file, nSize))
+        return false;
+    str.resize(nSize);
+    return nSize == 0 || fread(&str[0], 1, nSize, file) == nSize;
+}
+
+static bool ParseArg(const char *pszArg, const char *pszName, long &nValue)
+{
+    size_t nLen = strlen(pszName);
+    if (strncmp(pszArg, pszName, nLen) != 0 || pszArg[nLen] != '=')
+        return false;
+    nValue = atol(pszArg + nLen + 1);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr,
+                "Usage: dbbench <replay log> <new database directory> [options]\n"
+                "  -dbcache=<n>             Cache of the database in megabytes (default: 100)\n"
+                "  -bloombits=<n>           Bits per key of the bloom filters, 0 for none (default: 10)\n"
+                "  -compression             Compress table blocks with Snappy\n"
+                "  -writebufferpercent=<n>  Percentage of the cache used for the write buffer (default: 25)\n"
+                "  -maxopenfiles=<n>        Number of table files to keep open (default: 1000)\n"
+                "  -sync                    Write every batch synchronously\n");
+        return 1;
+    }
+
+    long nCacheMB = 100, nBloomBits = 10, nWriteBufferPercent = 25, nMaxOpenFiles = 1000;
+    bool fCompression = false, fSync = false;
+    for (int i = 3; i < argc; i++) {
+        if (ParseArg(argv[i], "-dbcache", nCacheMB) || ParseArg(argv[i], "-bloombits", nBloomBits) ||
+            ParseArg(argv[i], "-writebufferpercent", nWriteBufferPercent) || ParseArg(argv[i], "-maxopenfiles", nMaxOpenFiles))
+            continue;
+        if (strcmp(argv[i], "-compression") == 0)
+            fCompression = true;
+        else if (strcmp(argv[i], "-sync") == 0)
+            fSync = true;
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+    leveldb::Env *penv = leveldb::Env::Default();
+    if (penv->FileExists(argv[2])) {
+        fprintf(stderr, "%s exists already\n", argv[2]);
+        return 1;
+    }
+
+    // The same split of the cache as CLevelDB
+    size_t nCacheSize = (size_t)nCacheMB << 20;
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.write_buffer_size = nCacheSize / 100 * nWriteBufferPercent;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize - 2 * options.write_buffer_size);
+    if (nBloomBits > 0)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(nBloomBits);
+    options.compression = fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = nMaxOpenFiles;
+    leveldb::DB *pdb;
+    leveldb::Status status = leveldb::DB::Open(options, argv[2], &pdb);
+    if (!status.ok()) {
+        fprintf(stderr, "%s\n", status.ToString().c_str());
+        return 1;
+    }
+
+    leveldb::ReadOptions readoptions;
+    readoptions.verify_checksums = true;
+    leveldb::ReadOptions iteroptions;
+    iteroptions.verify_checksums = true;
+    iteroptions.fill_cache = false;
+    leveldb::WriteOptions writeoptions;
+    writeoptions.sync = fSync;
+
+    long nBatches = 0, nPuts = 0, nDeletes = 0, nReads = 0, nFound = 0, nSeeks = 0, nScanned = 0;
+    double dWriteTime = 0, dReadTime = 0, dSeekTime = 0;
+    leveldb::WriteBatch batch;
+    std::string strKey, strValue;
+    unsigned int nNext;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == 'W') {
+            double dStart = GetTime();
+            status = pdb->Write(writeoptions, &batch);
+            dWriteTime += GetTime() - dStart;
+            batch.Clear();
+            nBatches++;
+        } else if (c == 'P' && ReadSlice(file, strKey) && ReadSlice(file, strValue)) {
+            batch.Put(strKey, strValue);
+            nPuts++;
+        } else if (c == 'D' && ReadSlice(file, strKey)) {
+            batch.Delete(strKey);
+            nDeletes++;
+        } else if (c == 'G' && ReadSlice(file, strKey)) {
+            double dStart = GetTime();
+            status = pdb->Get(readoptions, strKey, &strValue);
+            dReadTime += GetTime() - dStart;
+            nReads++;
+            if (status.ok())
+                nFound++;
+            else if (status.IsNotFound())
+                status = leveldb::Status::OK();
+        } else if ((c == 'S' || c == 'I') && ReadSlice(file, strKey) && ReadSize(file, nNext)) {
+            // Visit the entries bitcoind did: the one sought and one per Next
+            double dStart = GetTime();
+            leveldb::Iterator *piter = pdb->NewIterator(c == 'S' ? readoptions : iteroptions);
+            piter->Seek(strKey);
+            for (unsigned int i = 0; piter->Valid(); i++) {
+                strValue.assign(piter->value().data(), piter->value().size());
+                nScanned++;
+                if (i == nNext)
+                    break;
+                piter->Next();
+            }
+            status = piter->status();
+            delete piter;
+            dSeekTime += GetTime() - dStart;
+            nSeeks++;
+        } else {
+            fprintf(stderr, "Truncated or corrupt replay log\n");
+            break;
+        }
+        if (!status.ok()) {
+            fprintf(stderr, "%s\n", status.ToString().c_str());
+            break;
+        }
+    }
+    fclose(file);
+
+    // Include the compactions still running in the write time
+    double dStart = GetTime();
+    std::string strStats;
+    pdb->GetProperty("leveldb.stats", &strStats);
+    delete pdb;
+    dWriteTime += GetTime() - dStart;
+
+    std::vector<std::string> vFiles;
+    uint64_t nDiskSize = 0;
+    penv->GetChildren(argv[2], &vFiles);
+    for (unsigned int i = 0; i < vFiles.size(); i++) {
+        uint64_t nSize;
+        if (penv->GetFileSize(std::string(argv[2]) + "/" + vFiles[i], &nSize).ok())
+            nDiskSize += nSize;
+    }
+
+    printf("%s", strStats.c_str());
+    printf("writes: %ld batches, %ld puts, %ld deletes, %.3fs\n", nBatches, nPuts, nDeletes, dWriteTime);
+    printf("reads:  %ld gets, %ld found, %.3fs, %.2fus per get\n", nReads, nFound, dReadTime, nReads ? dReadTime / nReads * 1e6 : 0);
+    printf("seeks:  %ld seeks, %ld entries, %.3fs, %.2fus per seek\n", nSeeks, nScanned, dSeekTime, nSeeks ? dSeekTime / nSeeks * 1e6 : 0);
+    printf("size on disk: %.1f MiB\n", nDiskSize / 1048576.0);
+
+    delete options.block_cache;
+    delete options.filter_policy;
+    return 0;
+}
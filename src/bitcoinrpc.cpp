@@ -283,7 +283,7 @@ static const CRPCCommand vRPCCommands[] =
     { "decodescript",           &decodescript,           false,     false },
     { "signrawtransaction",     &signrawtransaction,     false,     false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      true },
     { "gettxout",               &gettxout,               true,      false },
     { "lockunspent",            &lockunspent,            false,     false },
     { "listlockunspent",        &listlockunspent,        false,     false },
@@ -0,0 +1,23 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKMAP_H
+#define BITCOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <boost/unordered_map.hpp>
+
+class CBlockIndex;
+
+/** Block hashes are constrained by proof of work, so unlike txids they
+ *  cannot be ground to collide in a hash table; their low bits are random
+ *  enough as they are. */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+#endif
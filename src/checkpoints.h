@@ -4,9 +4,8 @@
 #ifndef BITCOIN_CHECKPOINT_H
 #define BITCOIN_CHECKPOINT_H
 
-#include <map>
+#include "blockmap.h"
 
-class uint256;
 class CBlockIndex;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
@@ -21,7 +20,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     double GuessVerificationProgress(CBlockIndex *pindex);
 
@@ -7,12 +7,36 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/foreach.hpp>
 
-#include <vector>
 #include <algorithm>
+#include <deque>
+#include <vector>
 
 template<typename T> class CCheckQueueControl;
 
+/** Counters describing how well a CCheckQueue's workers are kept busy */
+struct CCheckQueueStats
+{
+    // Number of batches taken from the queue
+    unsigned int nBatches;
+    // Number of checks taken from the queue of another thread
+    unsigned int nStolen;
+    // Number of times a thread had to wait for one of the queue's locks, and
+    // for how long in total (in microseconds)
+    unsigned int nLockContended;
+    long long nLockWaitTime;
+    // Time the master spent waiting for other workers to finish their
+    // batches after the queue ran empty (in microseconds)
+    long long nMasterWaitTime;
+    // Time the other workers spent waiting for checks while some were still
+    // unfinished, summed over the workers (in microseconds)
+    long long nWorkerIdleTime;
+
+    CCheckQueueStats() : nBatches(0), nStolen(0), nLockContended(0), nLockWaitTime(0), nMasterWaitTime(0), nWorkerIdleTime(0) {}
+};
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -21,9 +45,21 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * The verifications are spread over a number of sub-queues, one per
+  * thread, each with its own lock. A thread takes the newest from its own
+  * sub-queue, and steals the oldest from the others' when it runs dry. The
+  * mutex of the queue itself guards the counts, and is only held while
+  * checks are added, not while workers take them.
   */
 template<typename T> class CCheckQueue {
 private:
+    // A sub-queue, used as a LIFO by its thread and a FIFO by the others
+    struct CSubQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
     // Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -33,9 +69,15 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    // The sub-queues of elements to be processed, and their number.
+    // As the order of booleans doesn't matter, elements go to the
+    // sub-queue of the next worker in turn.
+    CSubQueue *pqueues;
+    unsigned int nQueues;
+    unsigned int nNextQueue;
+
+    // Number of elements in the sub-queues that no thread has claimed yet
+    unsigned int nQueued;
 
     // The number of workers (including the master) that are idle.
     int nIdle;
@@ -57,29 +99,101 @@ private:
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    // Statistics since the last call to GetStats
+    CCheckQueueStats stats;
+
+    // Workers waiting for checks while some are unfinished, and the sum of
+    // the times they started waiting. Their waits are only counted until no
+    // unfinished checks are left, which starts a new period.
+    int nIdleWaiting;
+    long long nIdleWaitStart;
+    unsigned int nPeriod;
+
+    static long long GetTimeMicros() {
+        return (boost::posix_time::microsec_clock::universal_time() - boost::posix_time::ptime(boost::posix_time::min_date_time)).total_microseconds();
+    }
+
+    // Acquire the lock, only timing it when it is contended. Waits for the
+    // locks of sub-queues are counted in a thread's own statsLock first.
+    static void Lock(boost::unique_lock<boost::mutex> &lock, CCheckQueueStats &statsLock) {
+        if (lock.try_lock())
+            return;
+        long long nStart = GetTimeMicros();
+        lock.lock();
+        statsLock.nLockContended++;
+        statsLock.nLockWaitTime += GetTimeMicros() - nStart;
+    }
+
+    // Move nCount elements claimed from nQueued into vChecks: the newest of
+    // sub-queue nHome first, then the oldest of the following ones. They
+    // are there, as elements are queued before they are counted.
+    void Take(unsigned int nHome, unsigned int nCount, std::vector<T> &vChecks, CCheckQueueStats &statsLocal) {
+        vChecks.resize(nCount);
+        unsigned int nTaken = 0;
+        for (unsigned int n = 0; nTaken < nCount; n++) {
+            bool fOwn = (n % nQueues == 0);
+            CSubQueue &sub = pqueues[(nHome + n) % nQueues];
+            boost::unique_lock<boost::mutex> lock(sub.mutex, boost::defer_lock);
+            Lock(lock, statsLocal);
+            while (nTaken < nCount && !sub.queue.empty()) {
+                // Swap jobs from the sub-queue to the local batch vector instead of copying
+                if (fOwn) {
+                    vChecks[nTaken].swap(sub.queue.back());
+                    sub.queue.pop_back();
+                } else {
+                    vChecks[nTaken].swap(sub.queue.front());
+                    sub.queue.pop_front();
+                    statsLocal.nStolen++;
+                }
+                nTaken++;
+            }
+        }
+    }
+
+    // All checks are finished: count the waits of idle workers until now
+    void EndPeriod() {
+        if (nIdleWaiting > 0)
+            stats.nWorkerIdleTime += nIdleWaiting * GetTimeMicros() - nIdleWaitStart;
+        nIdleWaiting = 0;
+        nIdleWaitStart = 0;
+        nPeriod++;
+    }
+
     // Internal function that does bulk of the verification work.
     bool Loop(bool fMaster = false) {
         boost::condition_variable &cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
+        unsigned int nHome = 0;
+        CCheckQueueStats statsLocal;
         bool fOk = true;
         do {
             {
-                boost::unique_lock<boost::mutex> lock(mutex);
+                boost::unique_lock<boost::mutex> lock(mutex, boost::defer_lock);
+                Lock(lock, stats);
                 // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
                 if (nNow) {
                     fAllOk &= fOk;
                     nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
+                    if (nTodo == 0) {
+                        EndPeriod();
+                        if (!fMaster)
+                            // We processed the last element; inform the master he can exit and return the result
+                            condMaster.notify_one();
+                    }
+                    stats.nStolen += statsLocal.nStolen;
+                    stats.nLockContended += statsLocal.nLockContended;
+                    stats.nLockWaitTime += statsLocal.nLockWaitTime;
+                    statsLocal = CCheckQueueStats();
                 } else {
-                    // first iteration
+                    // first iteration; the workers, which start before the
+                    // master joins, get the first sub-queues
+                    nHome = nTotal % nQueues;
                     nTotal++;
                 }
                 // logically, the do loop starts here
-                while (queue.empty()) {
+                while (nQueued == 0) {
                     if ((fMaster || fQuit) && nTodo == 0) {
                         nTotal--;
                         bool fRet = fAllOk;
@@ -90,7 +204,24 @@ private:
                         return fRet;
                     }
                     nIdle++;
-                    cond.wait(lock); // wait
+                    if (fMaster) {
+                        long long nStart = GetTimeMicros();
+                        cond.wait(lock); // wait
+                        stats.nMasterWaitTime += GetTimeMicros() - nStart;
+                    } else if (nTodo > 0) {
+                        long long nStart = GetTimeMicros();
+                        unsigned int nPeriodStart = nPeriod;
+                        nIdleWaiting++;
+                        nIdleWaitStart += nStart;
+                        cond.wait(lock); // wait
+                        if (nPeriod == nPeriodStart) {
+                            stats.nWorkerIdleTime += GetTimeMicros() - nStart;
+                            nIdleWaiting--;
+                            nIdleWaitStart -= nStart;
+                        }
+                    } else {
+                        cond.wait(lock); // wait
+                    }
                     nIdle--;
                 }
                 // Decide how many work units to process now.
@@ -98,17 +229,14 @@ private:
                 //   all workers finish approximately simultaneously.
                 // * Try to account for idle jobs which will instantly start helping.
                 // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
-                }
+                nNow = std::max(1U, std::min(nBatchSize, nQueued / (nTotal + nIdle + 1)));
+                nQueued -= nNow;
+                stats.nBatches++;
                 // Check whether we need to do work at all
                 fOk = fAllOk;
             }
+            // Claimed above, so they are taken outside of the queue's lock
+            Take(nHome, nNow, vChecks, statsLocal);
             // execute work
             BOOST_FOREACH(T &check, vChecks)
                 if (fOk)
@@ -118,9 +246,12 @@ private:
     }
 
 public:
-    // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    // Create a new check queue, with a sub-queue for each of up to
+    // nQueuesIn threads
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nQueuesIn = 1) :
+        pqueues(new CSubQueue[std::max(nQueuesIn, 1U)]), nQueues(std::max(nQueuesIn, 1U)), nNextQueue(0), nQueued(0),
+        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn),
+        nIdleWaiting(0), nIdleWaitStart(0), nPeriod(0) {}
 
     // Worker thread
     void Thread() {
@@ -134,19 +265,41 @@ public:
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        boost::unique_lock<boost::mutex> lock(mutex, boost::defer_lock);
+        Lock(lock, stats);
+        // Deal the batches out to the sub-queues of the running workers, in
+        // turn. Threads that take checks only hold the lock of a sub-queue,
+        // so holding both doesn't deadlock.
+        if (!vChecks.empty()) {
+            CSubQueue &sub = pqueues[nNextQueue++ % std::max(1U, std::min((unsigned int)nTotal, nQueues))];
+            boost::unique_lock<boost::mutex> lockSub(sub.mutex, boost::defer_lock);
+            Lock(lockSub, stats);
+            BOOST_FOREACH(T &check, vChecks) {
+                sub.queue.push_back(T());
+                check.swap(sub.queue.back());
+            }
         }
+        nQueued += vChecks.size();
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        // Only wake up as many idle workers as there are new checks, instead
+        // of having all of them contend for the lock to find an empty queue.
+        if (vChecks.size() >= (unsigned int)nIdle)
             condWorker.notify_all();
+        else
+            for (unsigned int i = 0; i < vChecks.size(); i++)
+                condWorker.notify_one();
+    }
+
+    // Return the statistics gathered since the previous call, and reset them
+    CCheckQueueStats GetStats() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCheckQueueStats ret = stats;
+        stats = CCheckQueueStats();
+        return ret;
     }
 
     ~CCheckQueue() {
+        delete[] pqueues;
     }
 
     friend class CCheckQueueControl<T>;
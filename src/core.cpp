@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "core.h"
+#include "sha256.h"
 #include "util.h"
 
 std::string COutPoint::ToString() const
@@ -73,8 +74,12 @@ void CTxOut::print() const
     LogPrintf("%s\n", ToString().c_str());
 }
 
+uint64 *CTransaction::pnHashCount = NULL;
+
 uint256 CTransaction::GetHash() const
 {
+    if (pnHashCount)
+        ++*pnHashCount;
     return SerializeHash(*this);
 }
 
@@ -233,34 +238,88 @@ uint256 CBlockHeader::GetHash() const
 uint256 CBlock::BuildMerkleTree() const
 {
     vMerkleTree.clear();
+    vMerkleTree.reserve(vtx.size() * 2 + 16); // upper bound for the tree, so no reallocation
     BOOST_FOREACH(const CTransaction& tx, vtx)
         vMerkleTree.push_back(tx.GetHash());
     int j = 0;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-        }
+        // Adjacent hashes are contiguous, so each pair is one 64-byte input
+        // and the whole level can be hashed in one batch. An odd hash at the
+        // end is paired with itself.
+        int nOut = vMerkleTree.size();
+        vMerkleTree.resize(nOut + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nOut].begin(), vMerkleTree[j].begin(), nSize / 2);
+        if (nSize & 1)
+            vMerkleTree.back() = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                      BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
         j += nSize;
     }
     return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
 }
 
-std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
+uint256 CBlock::ComputeMerkleRoot() const
 {
+    vMerkleTree.clear();
+    vMerkleTree.reserve(vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vMerkleTree.push_back(tx.GetHash());
     if (vMerkleTree.empty())
-        BuildMerkleTree();
+        return 0;
+
+    // Reduce a copy of the leaves in place, one level at a time. Output i
+    // only overwrites inputs 2i and 2i+1 after they have been read, and an
+    // odd hash at the end is duplicated so every level is a single batch.
+    size_t nSize = vMerkleTree.size();
+    std::vector<uint256> vHash(nSize + 1);
+    std::copy(vMerkleTree.begin(), vMerkleTree.end(), vHash.begin());
+    while (nSize > 1)
+    {
+        if (nSize & 1)
+        {
+            vHash[nSize] = vHash[nSize - 1];
+            nSize++;
+        }
+        SHA256D64(vHash[0].begin(), vHash[0].begin(), nSize / 2);
+        nSize /= 2;
+    }
+    return vHash[0];
+}
+
+std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
+{
     std::vector<uint256> vMerkleBranch;
-    int j = 0;
-    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    if (vMerkleTree.size() > vtx.size()) {
+        // BuildMerkleTree has stored the whole tree
+        int j = 0;
+        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            int i = std::min(nIndex^1, nSize-1);
+            vMerkleBranch.push_back(vMerkleTree[j+i]);
+            nIndex >>= 1;
+            j += nSize;
+        }
+        return vMerkleBranch;
+    }
+
+    // Otherwise reduce a local copy of the transaction hashes, like
+    // ComputeMerkleRoot, taking the sibling from each level. The block is not
+    // modified, as it may be shared with other threads.
+    size_t nSize = vtx.size();
+    std::vector<uint256> vHash(nSize + 1);
+    for (size_t i = 0; i < nSize; i++)
+        vHash[i] = (vMerkleTree.size() == nSize ? vMerkleTree[i] : vtx[i].GetHash());
+    while (nSize > 1)
     {
-        int i = std::min(nIndex^1, nSize-1);
-        vMerkleBranch.push_back(vMerkleTree[j+i]);
+        if (nSize & 1)
+        {
+            vHash[nSize] = vHash[nSize - 1];
+            nSize++;
+        }
+        vMerkleBranch.push_back(vHash[nIndex^1]);
+        SHA256D64(vHash[0].begin(), vHash[0].begin(), nSize / 2);
+        nSize /= 2;
         nIndex >>= 1;
-        j += nSize;
     }
     return vMerkleBranch;
 }
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_CORE_H
 #define BITCOIN_CORE_H
 
+#include "memusage.h"
 #include "uint256.h"
 #include "serialize.h"
 #include "script.h"
@@ -214,6 +215,10 @@ public:
     }
 
     uint256 GetHash() const;
+    // If set, GetHash counts the hashes it computes here. Tests set it to
+    // check that validation reuses hashes; meanwhile, only the thread that
+    // set it may hash transactions.
+    static uint64 *pnHashCount;
     bool IsNewerThan(const CTransaction& old) const;
 
     bool IsCoinBase() const
@@ -531,6 +536,14 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory owned by this object (the vout array and the scripts inside it)
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            ret += memusage::DynamicUsage(out.scriptPubKey);
+        return ret;
+    }
 };
 
 
@@ -615,6 +628,9 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        // Memory-only state describes the old contents of a reused block
+        if (fRead)
+            vMerkleTree.clear();
         READWRITE(*(CBlockHeader*)this);
         READWRITE(vtx);
     )
@@ -638,8 +654,13 @@ public:
         return block;
     }
 
+    // Build the whole merkle tree in vMerkleTree, as GetMerkleBranch needs
     uint256 BuildMerkleTree() const;
 
+    // Compute only the merkle root. vMerkleTree then just caches the
+    // transaction hashes for GetTxHash; the inner nodes are not kept.
+    uint256 ComputeMerkleRoot() const;
+
     const uint256 &GetTxHash(unsigned int nIndex) const {
         assert(vMerkleTree.size() > 0); // BuildMerkleTree must have been called first
         assert(nIndex < vtx.size());
@@ -40,6 +40,14 @@ public:
         Init();
     }
 
+    // Continue hashing from a state obtained with GetMidstate()
+    CHashWriter(int nTypeIn, int nVersionIn, const SHA256_CTX &ctxIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
+    const SHA256_CTX &GetMidstate() const {
+        return ctx;
+    }
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
@@ -19,6 +19,7 @@
 #include "miner.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "sha256.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -47,6 +48,9 @@ CClientUIInterface uiInterface;
 #define MIN_CORE_FILEDESCRIPTORS 150
 #endif
 
+// Default for -dbmaxopenfiles, and its limit on Windows
+#define DEFAULT_DB_MAX_OPEN_FILES 1000
+
 // Used to pass flags to the Bind() function
 enum BindFlags {
     BF_NONE         = 0,
@@ -119,9 +123,15 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+        bool fSnapshot = pblocktree && PrepareBlockIndexSnapshot(ssSnapshot);
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinswriter; pcoinswriter = NULL; // waits for the last write
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
+        // The snapshot records the block tree database's files as closed
+        if (fSnapshot)
+            WriteBlockIndexSnapshot(ssSnapshot);
     }
     bitdb.Flush(true);
     boost::filesystem::remove(GetPidFile());
@@ -177,6 +187,9 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbmaxopenfiles=<n>    " + _("Keep up to <n> files of each database open, if enough file descriptors are available; at most 1000 on Windows (default: 1000)") + "\n";
+    strUsage += "  -dbcompression         " + _("Compress the block and transaction index database (default: 0)") + "\n";
+    strUsage += "  -dbreplaylog=<file>    " + _("Append the writes and reads of the chainstate database to <file>, to replay with contrib/dbbench") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
     strUsage += "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n";
@@ -243,6 +256,7 @@ std::string HelpMessage()
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n";
     strUsage += "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n";
+    strUsage += "  -sigcachemb=<n>        " + _("Set signature cache size in megabytes (up to 1024, default: 4)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -424,6 +438,25 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
         nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
 
+    // MIN_CORE_FILEDESCRIPTORS includes 64 files for each of the two LevelDB
+    // databases. Let them keep more open only as far as the descriptor
+    // limit can be raised, and without pushing sockets beyond FD_SETSIZE.
+    // On Windows LevelDB holds handles rather than descriptors, which count
+    // against neither, so there the setting is only capped at the default.
+    int nDBMaxOpenFiles = std::max((int)GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES), 64);
+#ifdef WIN32
+    nDBMaxOpenFiles = std::min(nDBMaxOpenFiles, DEFAULT_DB_MAX_OPEN_FILES);
+#else
+    if (nDBMaxOpenFiles > 64) {
+        int nFDWanted = nMaxConnections + MIN_CORE_FILEDESCRIPTORS + 2 * (nDBMaxOpenFiles - 64);
+        nFDWanted = std::min(nFDWanted, (int)FD_SETSIZE - nBind);
+        if (nFDWanted > nFD)
+            nFD = RaiseFileDescriptorLimit(nFDWanted);
+        int nFDSpare = std::min(nFD, nFDWanted) - nMaxConnections - MIN_CORE_FILEDESCRIPTORS;
+        nDBMaxOpenFiles = std::min(nDBMaxOpenFiles, 64 + std::max(nFDSpare, 0) / 2);
+    }
+#endif
+
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     if (mapMultiArgs.count("-debug")) fDebug = true;
@@ -440,6 +473,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -maxsigcachesize used to be a number of entries, so an old value
+    // makes no sense as a size in megabytes
+    if (mapArgs.count("-maxsigcachesize"))
+        InitWarning(_("Warning: -maxsigcachesize is no longer supported and is ignored, use -sigcachemb to set the signature cache size in megabytes."));
+    int64 nSigCacheSize = GetArg("-sigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE);
+    nSigCacheSize = std::max((int64)0, std::min((int64)MAX_SIG_CACHE_SIZE, nSigCacheSize));
+    InitSignatureCache(nSigCacheSize << 20);
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -525,11 +566,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Bitcoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using SHA-256 merkle tree kernels: %s\n", SHA256D64Implementation().c_str());
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
     LogPrintf("Using data directory %s\n", strDataDir.c_str());
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
+    LogPrintf("Using at most %i open files per database\n", nDBMaxOpenFiles);
     std::ostringstream strErrors;
 
     if (fDaemon)
@@ -539,7 +582,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
     }
+    // The importer checks the next block and reads its inputs ahead on this
+    // thread, whatever -par is
+    threadGroup.create_thread(&ThreadBlockCheck);
 
     int64 nStart;
 
@@ -730,7 +778,23 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache, accounted in bytes
+
+    // The block index and the transaction index, when enabled, share a
+    // database. It is mostly iterated at startup, so bloom filters only help
+    // transaction lookups. Coin records are compressed already.
+    CLevelDBOptions blocktreeoptions;
+    blocktreeoptions.fCompression = GetBoolArg("-dbcompression", false);
+#ifndef USE_SNAPPY
+    if (blocktreeoptions.fCompression)
+        LogPrintf("Built without Snappy, -dbcompression has no effect\n");
+#endif
+    blocktreeoptions.nMaxOpenFiles = nDBMaxOpenFiles;
+    if (!GetBoolArg("-txindex", false))
+        blocktreeoptions.nBloomBits = 0;
+    CLevelDBOptions coinsoptions;
+    coinsoptions.nMaxOpenFiles = nDBMaxOpenFiles;
+    coinsoptions.strReplayLog = GetArg("-dbreplaylog", "");
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -744,12 +808,20 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinswriter;
+                pcoinswriter = NULL; // UnloadBlockIndex uses it
                 delete pcoinsdbview;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, blocktreeoptions);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex, coinsoptions);
+                pcoinswriter = new CCoinsViewBackgroundWriter(*pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(*pcoinswriter);
+
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -782,6 +854,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+            } catch(leveldb_error &e) {
+                // Explains, for one, a database compressed by a build with
+                // Snappy; rebuilding it is the way out
+                LogPrintf("%s\n", e.what());
+                strLoadError = strprintf("%s: %s", _("Error opening block database").c_str(), e.what());
+                break;
             } catch(std::exception &e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -830,7 +908,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -2,6 +2,10 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <map>
+
+#include <boost/thread/tss.hpp>
+
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
 #include <openssl/rand.h>
@@ -327,6 +331,69 @@ public:
     }
 };
 
+// Per-thread state for signature verification. Setting up the curve is
+// expensive, so each thread does it only once (with a table of multiples of
+// the generator, which every verification needs), and parsing public keys
+// (a square root for compressed ones) is avoided for recently used keys.
+// Being per thread, this needs no locking in the script checking threads.
+class CECVerifier {
+private:
+    static const unsigned int nMaxKeys = 64;
+
+    EC_GROUP *group;
+    std::map<CPubKey, EC_KEY*> mapKeys;
+
+    EC_KEY *GetKey(const CPubKey &pubkey) {
+        std::map<CPubKey, EC_KEY*>::iterator it = mapKeys.find(pubkey);
+        if (it != mapKeys.end())
+            return it->second;
+
+        EC_KEY *pkey = EC_KEY_new();
+        assert(pkey != NULL);
+        assert(EC_KEY_set_group(pkey, group));
+        const unsigned char* pbegin = pubkey.begin();
+        if (!o2i_ECPublicKey(&pkey, &pbegin, pubkey.size())) {
+            EC_KEY_free(pkey);
+            return NULL;
+        }
+        if (mapKeys.size() >= nMaxKeys) {
+            // Evict an arbitrary entry
+            it = mapKeys.lower_bound(pubkey);
+            if (it == mapKeys.end())
+                it = mapKeys.begin();
+            EC_KEY_free(it->second);
+            mapKeys.erase(it);
+        }
+        mapKeys.insert(std::make_pair(pubkey, pkey));
+        return pkey;
+    }
+
+public:
+    CECVerifier() {
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        assert(group != NULL);
+        assert(EC_GROUP_precompute_mult(group, NULL));
+    }
+
+    ~CECVerifier() {
+        for (std::map<CPubKey, EC_KEY*>::iterator it = mapKeys.begin(); it != mapKeys.end(); it++)
+            EC_KEY_free(it->second);
+        EC_GROUP_free(group);
+    }
+
+    bool Verify(const CPubKey &pubkey, const uint256 &hash, const std::vector<unsigned char>& vchSig) {
+        if (vchSig.empty())
+            return false;
+        EC_KEY *pkey = GetKey(pubkey);
+        if (pkey == NULL)
+            return false;
+        // -1 = error, 0 = bad sig, 1 = good
+        return ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1;
+    }
+};
+
+boost::thread_specific_ptr<CECVerifier> pverifier;
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -414,12 +481,9 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(*this))
-        return false;
-    if (!key.Verify(hash, vchSig))
-        return false;
-    return true;
+    if (pverifier.get() == NULL)
+        pverifier.reset(new CECVerifier());
+    return pverifier->Verify(*this, hash, vchSig);
 }
 
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
@@ -2,7 +2,12 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
 #include "leveldb.h"
+#include "hash.h"
 #include "util.h"
 
 #include <leveldb/env.h>
@@ -10,6 +15,8 @@
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#include <algorithm>
+
 #include <boost/filesystem.hpp>
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error) {
@@ -25,23 +32,124 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+uint256 GetLevelDBFilesHash(const boost::filesystem::path &path) {
+    leveldb::Env *penv = leveldb::Env::Default();
+    std::vector<std::string> vNames;
+    if (!penv->GetChildren(path.string(), &vNames).ok())
+        return 0;
+    std::sort(vNames.begin(), vNames.end());
+    CHashWriter ss(SER_GETHASH, 0);
+    for (unsigned int i = 0; i < vNames.size(); i++) {
+        const std::string &strName = vNames[i];
+        if (strName != "CURRENT" && strName.compare(0, 9, "MANIFEST-") != 0 &&
+            (strName.size() < 4 || strName.compare(strName.size() - 4, 4, ".log") != 0))
+            continue;
+        uint64_t nSize = 0;
+        if (!penv->GetFileSize((path / strName).string(), &nSize).ok())
+            return 0;
+        ss << strName << (uint64)nSize;
+    }
+    return ss.GetHash();
+}
+
+// The replay log is a sequence of records: a type, followed by the key
+// (except for 'W') and the value (only for 'P'), each preceded by its length
+// in 4 bytes, little endian. 'P' and 'D' are the puts and deletes of a batch,
+// 'W' writes the batch, and 'G' is a point read. 'S' and 'I' are iterator
+// seeks, through the block cache and around it, with the number of Next
+// calls that followed appended in 4 bytes, little endian.
+static void AppendReplayLog(std::string &str, const leveldb::Slice &sl) {
+    unsigned int nSize = sl.size();
+    for (int i = 0; i < 4; i++)
+        str.push_back((char)(nSize >> (8 * i)));
+    str.append(sl.data(), sl.size());
+}
+
+// Forwards to an iterator of the database and logs its seeks. A seek is
+// logged when the iterator seeks again or is deleted, once its Next calls
+// are known, so it may follow reads and writes that happened meanwhile.
+// SeekToLast and Prev are not logged.
+class CReplayLogIterator : public leveldb::Iterator
+{
+private:
+    leveldb::Iterator *piter;
+    FILE *file;
+    char chType;
+    std::string str;
+    unsigned int nNext;
+
+    void LogSeek(const leveldb::Slice &slKey) {
+        Flush();
+        str.push_back(chType);
+        AppendReplayLog(str, slKey);
+        nNext = 0;
+    }
+
+    void Flush() {
+        if (str.empty())
+            return;
+        for (int i = 0; i < 4; i++)
+            str.push_back((char)(nNext >> (8 * i)));
+        fwrite(str.data(), 1, str.size(), file);
+        str.clear();
+    }
+
+public:
+    CReplayLogIterator(leveldb::Iterator *piterIn, FILE *fileIn, bool fFillCache) :
+        piter(piterIn), file(fileIn), chType(fFillCache ? 'S' : 'I'), nNext(0) {}
+
+    ~CReplayLogIterator() {
+        Flush();
+        delete piter;
+    }
+
+    bool Valid() const { return piter->Valid(); }
+    void SeekToFirst() { LogSeek(leveldb::Slice()); piter->SeekToFirst(); }
+    void SeekToLast() { piter->SeekToLast(); }
+    void Seek(const leveldb::Slice &target) { LogSeek(target); piter->Seek(target); }
+    void Next() { nNext++; piter->Next(); }
+    void Prev() { piter->Prev(); }
+    leveldb::Slice key() const { return piter->key(); }
+    leveldb::Slice value() const { return piter->value(); }
+    leveldb::Status status() const { return piter->status(); }
+};
+
+class CReplayLogBatch : public leveldb::WriteBatch::Handler
+{
+public:
+    std::string str;
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value) {
+        str.push_back('P');
+        AppendReplayLog(str, key);
+        AppendReplayLog(str, value);
+    }
+
+    void Delete(const leveldb::Slice &key) {
+        str.push_back('D');
+        AppendReplayLog(str, key);
+    }
+};
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBOptions &dboptions) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.write_buffer_size = nCacheSize / 100 * dboptions.nWriteBufferPercent;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize - 2 * options.write_buffer_size); // up to two write buffers may be held in memory simultaneously
+    if (dboptions.nBloomBits > 0)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(dboptions.nBloomBits);
+    options.compression = dboptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dboptions.nMaxOpenFiles;
     return options;
 }
 
-CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
+CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBOptions &dboptions) {
     penv = NULL;
+    fileReplayLog = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dboptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -51,15 +159,45 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
             LogPrintf("Wiping LevelDB in %s\n", path.string().c_str());
             leveldb::DestroyDB(path.string(), options);
         }
+        hashFilesAtOpen = GetLevelDBFilesHash(path);
         boost::filesystem::create_directory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string().c_str());
+        LogPrintf("Opening LevelDB in %s (compression=%d, max open files=%d, bloom bits=%d)\n", path.string().c_str(),
+                  dboptions.fCompression, dboptions.nMaxOpenFiles, dboptions.nBloomBits);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+    // Only a LevelDB built with Snappy can read the table blocks it
+    // compressed, and it compresses nothing otherwise. A database that may
+    // hold such blocks stays marked as such, as they are only rewritten by
+    // compactions.
+    static const std::string strSnappyKey("snappy");
+#ifdef USE_SNAPPY
+    if (dboptions.fCompression && !Exists(strSnappyKey))
+        Write(strSnappyKey, true, true);
+#else
+    if (Exists(strSnappyKey)) {
+        delete pdb;
+        pdb = NULL;
+        LogPrintf("LevelDB in %s was compressed with Snappy, which this build lacks\n", path.string().c_str());
+        throw leveldb_error("Database compressed with Snappy, which this build does not support");
+    }
+#endif
+    if (!dboptions.strReplayLog.empty()) {
+        // Records are written with a single fwrite each, which stdio keeps
+        // whole when several threads read the database
+        fileReplayLog = fopen(dboptions.strReplayLog.c_str(), "ab");
+        if (fileReplayLog)
+            LogPrintf("Logging writes and reads of %s to %s\n", path.string().c_str(), dboptions.strReplayLog.c_str());
+        else
+            LogPrintf("Unable to open replay log %s\n", dboptions.strReplayLog.c_str());
+    }
 }
 
 CLevelDB::~CLevelDB() {
+    if (fileReplayLog)
+        fclose(fileReplayLog);
+    fileReplayLog = NULL;
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -73,5 +211,21 @@ CLevelDB::~CLevelDB() {
 bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     HandleError(status);
+    if (fileReplayLog) {
+        CReplayLogBatch log;
+        batch.batch.Iterate(&log);
+        log.str.push_back('W');
+        fwrite(log.str.data(), 1, log.str.size(), fileReplayLog);
+    }
     return true;
 }
+
+leveldb::Iterator *CLevelDB::LogIterator(leveldb::Iterator *piter, bool fFillCache) {
+    return new CReplayLogIterator(piter, fileReplayLog, fFillCache);
+}
+
+void CLevelDB::LogRead(const leveldb::Slice &slKey) {
+    std::string str(1, 'G');
+    AppendReplayLog(str, slKey);
+    fwrite(str.data(), 1, str.size(), fileReplayLog);
+}
@@ -20,6 +20,12 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+// Hash of the names and sizes of the files in the database directory path
+// that LevelDB changes whenever the database is opened or written: CURRENT,
+// the manifests and the logs. Cheap, as it doesn't open the database. 0 if
+// there is no such directory, as for in-memory databases.
+uint256 GetLevelDBFilesHash(const boost::filesystem::path &path);
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -53,6 +59,31 @@ public:
     }
 };
 
+/** Tuning of a CLevelDB, which can differ per database */
+struct CLevelDBOptions
+{
+    // Compress table blocks with Snappy. LevelDB stores them uncompressed
+    // anyway if it was built without Snappy. Once compressed, a database
+    // can't be opened by a build without Snappy.
+    bool fCompression;
+
+    // Number of table files LevelDB may keep open
+    int nMaxOpenFiles;
+
+    // Bits per key of the bloom filters, or 0 for none
+    int nBloomBits;
+
+    // Percentage of the cache used for the write buffer; up to two write
+    // buffers may be held in memory simultaneously, the rest is block cache
+    int nWriteBufferPercent;
+
+    // File to append the written batches, point reads and iterator seeks to,
+    // to replay them with contrib/dbbench, or empty for none
+    std::string strReplayLog;
+
+    CLevelDBOptions() : fCompression(false), nMaxOpenFiles(64), nBloomBits(10), nWriteBufferPercent(25) {}
+};
+
 class CLevelDB
 {
 private:
@@ -77,8 +108,17 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    // replay log of this database (may be NULL)
+    FILE *fileReplayLog;
+
+    // GetLevelDBFilesHash of the database just before it was opened
+    uint256 hashFilesAtOpen;
+
+    void LogRead(const leveldb::Slice &slKey);
+    leveldb::Iterator *LogIterator(leveldb::Iterator *piter, bool fFillCache);
+
 public:
-    CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBOptions &dboptions = CLevelDBOptions());
     ~CLevelDB();
 
     template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
@@ -87,6 +127,8 @@ public:
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        if (fileReplayLog)
+            LogRead(slKey);
         std::string strValue;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
         if (!status.ok()) {
@@ -116,6 +158,8 @@ public:
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        if (fileReplayLog)
+            LogRead(slKey);
         std::string strValue;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
         if (!status.ok()) {
@@ -135,6 +179,12 @@ public:
 
     bool WriteBatch(CLevelDBBatch &batch, bool fSync = false) throw(leveldb_error);
 
+    // Compare with GetLevelDBFilesHash taken when the database was last
+    // closed to find out whether anything opened it in between
+    const uint256 &GetFilesHashAtOpen() const {
+        return hashFilesAtOpen;
+    }
+
     // not available for LevelDB; provide for compatibility with BDB
     bool Flush() {
         return true;
@@ -147,7 +197,33 @@ public:
 
     // not exactly clean encapsulation, but it's easiest for now
     leveldb::Iterator *NewIterator() {
-        return pdb->NewIterator(iteroptions);
+        leveldb::Iterator *piter = pdb->NewIterator(iteroptions);
+        return fileReplayLog ? LogIterator(piter, false) : piter;
+    }
+
+    // Iterator for short scans near a key just read, which, like Read, keeps
+    // the blocks it touches in the block cache
+    leveldb::Iterator *NewCachingIterator() {
+        leveldb::Iterator *piter = pdb->NewIterator(readoptions);
+        return fileReplayLog ? LogIterator(piter, true) : piter;
+    }
+
+    // A consistent view of the database as it is now, unaffected by later
+    // writes. It must be released with ReleaseSnapshot.
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *psnapshot) {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
+
+    // Iterate over the database as it was when psnapshot was taken
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *psnapshot) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = psnapshot;
+        leveldb::Iterator *piter = pdb->NewIterator(options);
+        return fileReplayLog ? LogIterator(piter, false) : piter;
     }
 };
 
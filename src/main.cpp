@@ -15,6 +15,8 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 using namespace std;
 using namespace boost;
@@ -31,7 +33,45 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+
+/** Storage for the CBlockIndex entries of mapBlockIndex. They are handed out
+ *  from large chunks rather than allocated one by one, which saves the
+ *  allocator overhead on hundreds of thousands of small objects, and keeps
+ *  entries created together (a chain being extended) next to each other in
+ *  memory. Entries are never freed individually, only all at once by Clear.
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t nChunkSize = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed; // entries used in the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(nChunkSize) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* New()
+    {
+        if (nUsed == nChunkSize) {
+            vChunks.push_back(new CBlockIndex[nChunkSize]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = nChunkSize;
+    }
+};
+
+static CBlockIndexArena blockindexarena;
+static bool fBlockIndexLoaded = false; // whether mapBlockIndex reflects the block tree database
 std::vector<CBlockIndex*> vBlockIndexByHeight;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
@@ -46,7 +86,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fHaveGUI = false;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -195,7 +235,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 
 CBlockLocator::CBlockLocator(uint256 hashBlock)
 {
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi != mapBlockIndex.end())
         Set((*mi).second);
 }
@@ -208,9 +248,12 @@ void CBlockLocator::Set(const CBlockIndex* pindex)
     {
         vHave.push_back(pindex->GetBlockHash());
 
-        // Exponentially larger steps back
-        for (int i = 0; pindex && i < nStep; i++)
-            pindex = pindex->pprev;
+        // Exponentially larger steps back. On the main chain the height
+        // index finds the ancestor directly, elsewhere the skiplist does.
+        int nHeight = pindex->nHeight - nStep;
+        if (nHeight < 0)
+            break;
+        pindex = pindex->IsInMainChain() ? vBlockIndexByHeight[nHeight] : pindex->GetAncestor(nHeight);
         if (vHave.size() > 10)
             nStep *= 2;
     }
@@ -224,7 +267,7 @@ int CBlockLocator::GetDistanceBack()
     int nStep = 1;
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -243,7 +286,7 @@ CBlockIndex *CBlockLocator::GetBlockIndex()
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -259,7 +302,7 @@ uint256 CBlockLocator::GetBlockHash()
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -283,12 +326,14 @@ int CBlockLocator::GetHeight()
 // CCoinsView implementations
 //
 
+CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
 bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -299,43 +344,78 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0), nDirtyEntries(0), hasModifier(false) { }
+
+CCoinsViewCache::~CCoinsViewCache()
+{
+    assert(!hasModifier);
+}
+
+int CCoinsViewCache::GetAccessHeight() const {
+    return pindexTip ? pindexTip->nHeight : 0;
+}
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
-    }
-    return false;
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->second.coins;
+    return true;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end()) {
+        it->second.nAccessHeight = GetAccessHeight();
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    ret->second.SetStored(ret->second.coins);
+    if (ret->second.coins.IsPruned()) {
+        // The parent only has an empty entry for this txid; we can consider our
+        // version as fresh.
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    ret->second.nAccessHeight = GetAccessHeight();
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
-CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+const CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    return it->second.coins;
+}
+
+CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
+    assert(!hasModifier);
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end()) {
+        // The parent view does not have this entry; mark it as fresh.
+        it = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+        it->second.flags = CCoinsCacheEntry::FRESH;
+        it->second.nAccessHeight = GetAccessHeight();
+        it->second.SetStored(CCoins());
+    }
+    // Assume that whenever ModifyCoins is called, the entry will be modified.
+    if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        nDirtyEntries++;
+        vDirtyKeys.push_back(txid);
+    }
+    return CCoinsModifier(*this, it, it->second.coins.DynamicMemoryUsage());
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    CCoinsModifier entry = ModifyCoins(txid);
+    *entry = coins;
     return true;
 }
 
@@ -354,24 +434,436 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    assert(!hasModifier);
+    int nHeight = pindex ? pindex->nHeight : 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) // Ignore non-dirty entries (optimization).
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH) || !it->second.coins.IsPruned()) {
+                // The parent cache does not have an entry, while the child
+                // cache does. Move the data up, and mark it as dirty (and
+                // fresh, if the child's entry was: then our parent lacks it too).
+                CCoinsCacheEntry& entry = cacheCoins[it->first];
+                entry.coins.swap(it->second.coins);
+                cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+                entry.flags = CCoinsCacheEntry::DIRTY | (it->second.flags & CCoinsCacheEntry::FRESH);
+                entry.nAccessHeight = nHeight;
+                // What our own base holds is only known if it has nothing
+                if (entry.flags & CCoinsCacheEntry::FRESH)
+                    entry.SetStored(CCoins());
+                nDirtyEntries++;
+                vDirtyKeys.push_back(it->first);
+            }
+        } else {
+            if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+                // The grandparent does not have an entry, and the child is
+                // modified and being pruned. This means we can just delete
+                // it from the parent.
+                if (itUs->second.flags & CCoinsCacheEntry::DIRTY)
+                    nDirtyEntries--;
+                cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                cacheCoins.erase(itUs);
+            } else {
+                // A normal modification.
+                cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                itUs->second.coins.swap(it->second.coins);
+                cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
+                if (!(itUs->second.flags & CCoinsCacheEntry::DIRTY)) {
+                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    nDirtyEntries++;
+                    vDirtyKeys.push_back(it->first);
+                }
+                itUs->second.nAccessHeight = nHeight;
+            }
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+        nDirtyEntries = 0;
+        vDirtyKeys.clear();
+    }
     return fOk;
 }
 
+bool CCoinsViewCache::Sync() {
+    assert(!hasModifier);
+    // BatchWrite may swap data out of the map it is given, so hand it copies
+    // of the dirty entries only. Only the listed keys can be dirty.
+    CCoinsMap mapDirty;
+    BOOST_FOREACH(const uint256 &txid, vDirtyKeys) {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        if (it != cacheCoins.end() && (it->second.flags & CCoinsCacheEntry::DIRTY))
+            mapDirty.insert(*it);
+    }
+    if (!base->BatchWrite(mapDirty, pindexTip))
+        return false;
+    // The base now agrees with us on every entry. Pruned entries carry no
+    // information anymore, so drop them; everything else becomes clean.
+    BOOST_FOREACH(const uint256 &txid, vDirtyKeys) {
+        CCoinsMap::iterator it = cacheCoins.find(txid);
+        if (it == cacheCoins.end() || !(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        if (it->second.coins.IsPruned()) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it);
+        } else {
+            it->second.flags = 0;
+            it->second.SetStored(it->second.coins);
+        }
+    }
+    nDirtyEntries = 0;
+    vDirtyKeys.clear();
+    return true;
+}
+
+void CCoinsViewCache::Trim(size_t nMaxUsage) {
+    size_t nUsage = DynamicMemoryUsage();
+    if (nUsage <= nMaxUsage)
+        return;
+
+    // Build a histogram of evictable memory by access height, and find the
+    // most recent height up to which entries must go to get under the limit.
+    static const size_t nEntryOverhead = memusage::MallocUsage(sizeof(memusage::boost_unordered_node<CCoinsMap::value_type>));
+    std::map<int, size_t> mapUsageByHeight;
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            mapUsageByHeight[it->second.nAccessHeight] += nEntryOverhead + it->second.coins.DynamicMemoryUsage();
+    if (mapUsageByHeight.empty())
+        return;
+    int nCutoffHeight = mapUsageByHeight.begin()->first;
+    for (std::map<int, size_t>::const_iterator it = mapUsageByHeight.begin(); it != mapUsageByHeight.end(); it++) {
+        nCutoffHeight = it->first;
+        nUsage -= std::min(nUsage, it->second);
+        if (nUsage <= nMaxUsage)
+            break;
+    }
+
+    CCoinsMap::iterator it = cacheCoins.begin();
+    while (it != cacheCoins.end()) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY) && it->second.nAccessHeight <= nCutoffHeight) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            it++;
+        }
+    }
+}
+
+unsigned int CCoinsViewCache::Prefetch(const std::vector<uint256> &vTxid, CCheckQueue<CCoinsPrefetch> *pqueue) {
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const uint256 &txid, vTxid)
+        if (cacheCoins.find(txid) == cacheCoins.end())
+            vMissing.push_back(txid);
+    if (vMissing.empty())
+        return 0;
+
+    // Do the lookups in the base view without touching the cache, which is
+    // not thread-safe, and only merge the results afterwards.
+    std::vector<std::pair<bool, CCoins> > vResult(vMissing.size());
+    {
+        CCheckQueueControl<CCoinsPrefetch> control(pqueue);
+        std::vector<CCoinsPrefetch> vPrefetch;
+        vPrefetch.reserve(vMissing.size());
+        for (unsigned int i = 0; i < vMissing.size(); i++) {
+            vPrefetch.push_back(CCoinsPrefetch());
+            CCoinsPrefetch prefetch(*base, vMissing[i], vResult[i]);
+            prefetch.swap(vPrefetch.back());
+        }
+        if (pqueue == NULL) {
+            BOOST_FOREACH(CCoinsPrefetch &prefetch, vPrefetch)
+                prefetch();
+        }
+        control.Add(vPrefetch);
+        control.Wait();
+    }
+
+    // Lookups that failed are not cached: FetchCoins will retry them.
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        if (!vResult[i].first)
+            continue;
+        std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(vMissing[i], CCoinsCacheEntry()));
+        if (!ret.second)
+            continue;
+        CCoinsCacheEntry &entry = ret.first->second;
+        vResult[i].second.swap(entry.coins);
+        entry.SetStored(entry.coins);
+        if (entry.coins.IsPruned())
+            entry.flags = CCoinsCacheEntry::FRESH;
+        entry.nAccessHeight = GetAccessHeight();
+        cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+    }
+    return vMissing.size();
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+unsigned int CCoinsViewCache::GetDirtyCacheSize() const {
+    return nDirtyEntries;
+}
+
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    return memusage::DynamicUsage(cacheCoins) + memusage::DynamicUsage(vDirtyKeys) + cachedCoinsUsage;
+}
+
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
+    assert(!cache.hasModifier);
+    cache.hasModifier = true;
+}
+
+CCoinsModifier::~CCoinsModifier()
+{
+    assert(cache.hasModifier);
+    cache.hasModifier = false;
+    it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
+    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+        cache.nDirtyEntries--;
+        cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+    }
+}
+
+CCoinsViewBackgroundWriter::CCoinsViewBackgroundWriter(CCoinsView &baseIn) : CCoinsViewBacked(baseIn), pindexWriting(NULL), nWritingUsage(0), nWrites(0), fWriting(false), fFailed(false), fStop(false) {
+    nPrefetchedUsage[0] = nPrefetchedUsage[1] = 0;
+    threadGroup.create_thread(boost::bind(&CCoinsViewBackgroundWriter::ThreadWrite, this));
+}
+
+CCoinsViewBackgroundWriter::~CCoinsViewBackgroundWriter() {
+    // Finish the pending write first
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    cond.notify_all();
+    threadGroup.join_all();
+}
+
+void CCoinsViewBackgroundWriter::ThreadWrite() {
+    RenameThread("bitcoin-coinwriter");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        while (!fWriting && !fStop)
+            cond.wait(lock);
+        if (!fWriting)
+            return;
+        // The batch is not modified until it is written, so lookups can
+        // read it meanwhile
+        lock.unlock();
+        bool fOk = false;
+        try {
+            fOk = base->BatchWrite(mapWriting, pindexWriting);
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadWrite()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadWrite()");
+        }
+        CCoinsMap mapWritten;
+        lock.lock();
+        if (fOk) {
+            mapWritten.swap(mapWriting);
+            pindexWriting = NULL;
+            nWritingUsage = 0;
+        } else {
+            // Keep answering lookups from the batch; the base lacks it
+            LogPrintf("ERROR: CCoinsViewBackgroundWriter::ThreadWrite() : failed to write coins\n");
+            fFailed = true;
+        }
+        fWriting = false;
+        cond.notify_all();
+        // Free the written batch without holding up lookups
+        lock.unlock();
+        mapWritten.clear();
+        lock.lock();
+    }
+}
+
+bool CCoinsViewBackgroundWriter::Wait() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+size_t CCoinsViewBackgroundWriter::DynamicMemoryUsage() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nWritingUsage + memusage::DynamicUsage(mapPrefetched[0]) + nPrefetchedUsage[0] +
+           memusage::DynamicUsage(mapPrefetched[1]) + nPrefetchedUsage[1];
+}
+
+bool CCoinsViewBackgroundWriter::TakePrefetched(const uint256 &txid, CCoins &coins) {
+    for (int i = 0; i < 2; i++) {
+        std::map<uint256, CCoins>::iterator it = mapPrefetched[i].find(txid);
+        if (it != mapPrefetched[i].end()) {
+            nPrefetchedUsage[i] -= it->second.DynamicMemoryUsage();
+            coins.swap(it->second);
+            mapPrefetched[i].erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void CCoinsViewBackgroundWriter::ErasePrefetched(const uint256 &txid) {
+    for (int i = 0; i < 2; i++) {
+        std::map<uint256, CCoins>::iterator it = mapPrefetched[i].find(txid);
+        if (it != mapPrefetched[i].end()) {
+            nPrefetchedUsage[i] -= it->second.DynamicMemoryUsage();
+            mapPrefetched[i].erase(it);
+        }
+    }
+}
+
+unsigned int CCoinsViewBackgroundWriter::Prefetch(const std::vector<uint256> &vTxid) {
+    unsigned int nWritesStart;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // Keep what the previous call read, as its block may still be
+        // being connected, but drop what the one before did not use
+        mapPrefetched[1].swap(mapPrefetched[0]);
+        nPrefetchedUsage[1] = nPrefetchedUsage[0];
+        mapPrefetched[0].clear();
+        nPrefetchedUsage[0] = 0;
+        nWritesStart = nWrites;
+    }
+
+    // Read from the base without holding the lock, so lookups and writes
+    // can proceed meanwhile. Coins in the pending batch are in memory
+    // already.
+    std::vector<std::pair<uint256, CCoins> > vRead;
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (mapWriting.count(txid) || mapPrefetched[0].count(txid) || mapPrefetched[1].count(txid))
+                continue;
+        }
+        CCoins coins;
+        try {
+            if (!base->GetCoins(txid, coins))
+                continue;
+        } catch (std::exception &e) {
+            // Not an error here: the lookup is retried when the block is connected
+            continue;
+        }
+        vRead.push_back(std::make_pair(txid, CCoins()));
+        vRead.back().second.swap(coins);
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // A write queued meanwhile may have changed coins that were read
+    if (nWrites != nWritesStart)
+        return 0;
+    for (unsigned int i = 0; i < vRead.size(); i++) {
+        std::pair<std::map<uint256, CCoins>::iterator, bool> ret = mapPrefetched[0].insert(std::make_pair(vRead[i].first, CCoins()));
+        if (!ret.second)
+            continue;
+        ret.first->second.swap(vRead[i].second);
+        nPrefetchedUsage[0] += ret.first->second.DynamicMemoryUsage();
+    }
+    return vRead.size();
+}
+
+void CCoinsViewBackgroundWriter::UnloadBlockIndex() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        cond.wait(lock);
+    // Only left over when the write failed
+    pindexWriting = NULL;
+}
+
+bool CCoinsViewBackgroundWriter::GetCoins(const uint256 &txid, CCoins &coins) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = mapWriting.find(txid);
+        if (it != mapWriting.end()) {
+            coins = it->second.coins;
+            return true;
+        }
+        // The caller caches what it looks up, so prefetched coins are only
+        // needed once
+        if (TakePrefetched(txid, coins))
+            return true;
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewBackgroundWriter::HaveCoins(const uint256 &txid) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (mapWriting.count(txid) || mapPrefetched[0].count(txid) || mapPrefetched[1].count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewBackgroundWriter::SetCoins(const uint256 &txid, const CCoins &coins) {
+    // Direct writes must not be overtaken by the pending batch
+    if (!Wait())
+        return false;
+    bool fOk = base->SetCoins(txid, coins);
+    boost::unique_lock<boost::mutex> lock(mutex);
+    ErasePrefetched(txid);
+    nWrites++;
+    return fOk;
+}
+
+CBlockIndex *CCoinsViewBackgroundWriter::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pindexWriting)
+            return pindexWriting;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundWriter::SetBestBlock(CBlockIndex *pindex) {
+    if (!Wait())
+        return false;
+    return base->SetBestBlock(pindex);
+}
+
+bool CCoinsViewBackgroundWriter::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    size_t nUsage = memusage::DynamicUsage(mapCoins);
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        nUsage += it->second.coins.DynamicMemoryUsage();
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fWriting)
+            cond.wait(lock);
+        if (fFailed)
+            return false;
+        // mapWriting is empty now, so the caller gets an empty map back
+        mapWriting.swap(mapCoins);
+        pindexWriting = pindex;
+        nWritingUsage = nUsage;
+        for (CCoinsMap::const_iterator it = mapWriting.begin(); it != mapWriting.end(); it++)
+            ErasePrefetched(it->first);
+        nWrites++;
+        fWriting = true;
+    }
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewBackgroundWriter::GetStats(CCoinsStats &stats) {
+    if (!Wait())
+        return false;
+    return base->GetStats(stats);
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -392,6 +884,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewBackgroundWriter *pcoinswriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -399,9 +892,8 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const uint256& hash, const CTransaction& tx)
 {
-    uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
@@ -428,6 +920,11 @@ bool AddOrphanTx(const CTransaction& tx)
     return true;
 }
 
+bool AddOrphanTx(const CTransaction& tx)
+{
+    return AddOrphanTx(tx.GetHash(), tx);
+}
+
 void static EraseOrphanTx(uint256 hash)
 {
     if (!mapOrphanTransactions.count(hash))
@@ -677,7 +1174,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -788,6 +1285,12 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 
 bool CTxMemPool::accept(CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs)
+{
+    return accept(state, tx, tx.GetHash(), fLimitFree, pfMissingInputs);
+}
+
+bool CTxMemPool::accept(CValidationState &state, const CTransaction &tx, const uint256 &hash,
+                        bool fLimitFree, bool* pfMissingInputs)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -810,7 +1313,6 @@ bool CTxMemPool::accept(CValidationState &state, const CTransaction &tx, bool fL
                      reason.c_str());
 
     // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
     {
         LOCK(cs);
         if (mapTx.count(hash))
@@ -968,11 +1470,15 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
 
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
+{
+    return remove(tx.GetHash(), tx, fRecursive);
+}
+
+bool CTxMemPool::remove(const uint256 &hash, const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        uint256 hash = tx.GetHash();
         if (fRecursive) {
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
@@ -1032,7 +1538,7 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
             if (it2 != mapTx.end()) {
                 assert(it2->second.vout.size() > txin.prevout.n && !it2->second.vout[txin.prevout.n].IsNull());
             } else {
-                CCoins &coins = pcoins->GetCoins(txin.prevout.hash);
+                const CCoins &coins = pcoins->GetCoins(txin.prevout.hash);
                 assert(coins.IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
@@ -1072,7 +1578,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1176,9 +1682,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     }
 
     if (pindexSlow) {
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        boost::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pindexSlow);
+        if (pblock) {
+            BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -1201,10 +1707,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    if (nHeight >= (int)vBlockIndexByHeight.size())
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
         return NULL;
     return vBlockIndexByHeight[nHeight];
 }
@@ -1235,10 +1740,106 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
+/** Read-only mappings of the most recently read block files. Reading a
+ *  block from one is a lookup instead of an fopen/fseek/fread sequence, and
+ *  the block is deserialized straight from the page cache. The regions are
+ *  reference counted, so a reader keeps its mapping alive even if it gets
+ *  evicted meanwhile. Only finalized block files are mapped: they no longer
+ *  change, whereas the current one grows, and gets truncated when it is
+ *  finalized, which Windows refuses while any reader still has it mapped.
+ */
+class CBlockFileMappings
+{
+public:
+    typedef boost::shared_ptr<interprocess::mapped_region> region_ptr;
+
+private:
+    CCriticalSection cs;
+    std::list<std::pair<int, region_ptr> > listMapped; // most recently used first
+
+public:
+    // Return a mapping of the whole of block file nFile if it covers at
+    // least its first nEnd bytes, or NULL. Reading past the end of a file
+    // through a mapping raises SIGBUS, so a mapping covers the size the file
+    // had when it was made, which for a finalized file is final.
+    region_ptr Get(int nFile, uint64 nEnd)
+    {
+        // Whole block files do not fit in a 32-bit address space several times
+        if (sizeof(void*) < 8)
+            return region_ptr();
+
+        {
+            LOCK(cs_LastBlockFile);
+            if (nFile >= nLastBlockFile)
+                return region_ptr();
+        }
+
+        LOCK(cs);
+        for (std::list<std::pair<int, region_ptr> >::iterator it = listMapped.begin(); it != listMapped.end(); it++) {
+            if (it->first != nFile)
+                continue;
+            region_ptr region = it->second;
+            if (it != listMapped.begin())
+                listMapped.splice(listMapped.begin(), listMapped, it);
+            return region->get_size() >= nEnd ? region : region_ptr();
+        }
+
+        boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+        boost::system::error_code ec;
+        uint64 nFileSize = boost::filesystem::file_size(path, ec);
+        if (ec || nFileSize == 0)
+            return region_ptr();
+        region_ptr region;
+        try {
+            interprocess::file_mapping mapping(path.string().c_str(), interprocess::read_only);
+            region.reset(new interprocess::mapped_region(mapping, interprocess::read_only, 0, nFileSize));
+        } catch (std::exception &e) {
+            LogPrint("db", "Unable to map %s: %s\n", path.string().c_str(), e.what());
+            return region_ptr();
+        }
+        listMapped.push_front(std::make_pair(nFile, region));
+        if (listMapped.size() > MAX_MAPPED_BLOCKFILES)
+            listMapped.pop_back();
+        return region->get_size() >= nEnd ? region : region_ptr();
+    }
+};
+
+static CBlockFileMappings blockfilemappings;
+
+// Read a block through a mapping of its file. Returns false if that is not
+// possible, in which case the caller reads the file the normal way.
+static bool ReadBlockFromMapping(CBlock& block, const CDiskBlockPos& pos)
+{
+    // The size of the block is stored right before it
+    if (pos.IsNull() || pos.nPos < sizeof(unsigned int))
+        return false;
+    CBlockFileMappings::region_ptr region = blockfilemappings.Get(pos.nFile, pos.nPos);
+    if (!region)
+        return false;
+    const char *pbegin = (const char*)region->get_address();
+    unsigned int nSize = 0;
+    try {
+        CBufferReader(pbegin + pos.nPos - sizeof(nSize), pbegin + pos.nPos, SER_DISK, CLIENT_VERSION) >> nSize;
+        if ((uint64)pos.nPos + nSize > region->get_size())
+            return false;
+        CBufferReader(pbegin + pos.nPos, pbegin + pos.nPos + nSize, SER_DISK, CLIENT_VERSION) >> block;
+    } catch (std::exception &e) {
+        block.SetNull();
+        return false;
+    }
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
+    if (ReadBlockFromMapping(block, pos)) {
+        if (!CheckProofOfWork(block.GetHash(), block.nBits))
+            return error("ReadBlockFromDisk(CBlock&, CDiskBlockPos&) : errors in block header");
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (!filein)
@@ -1268,6 +1869,78 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+/** Recently read blocks, so that serving a new tip to every peer that asks
+ *  for it, or repeated RPC lookups, do not read and parse the same block
+ *  again each time. Bounded by MAX_BLOCK_READ_CACHE_SIZE bytes of
+ *  serialized block data, which is only a handful of blocks, so a list in
+ *  most recently used order does.
+ */
+class CBlockReadCache
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        boost::shared_ptr<const CBlock> pblock;
+        unsigned int nSize;
+    };
+
+    CCriticalSection cs;
+    std::list<CEntry> listBlocks; // most recently used first
+    uint64 nTotalSize;
+
+public:
+    CBlockReadCache() : nTotalSize(0) {}
+
+    boost::shared_ptr<const CBlock> Get(const uint256 &hash)
+    {
+        LOCK(cs);
+        for (std::list<CEntry>::iterator it = listBlocks.begin(); it != listBlocks.end(); it++) {
+            if (it->hash == hash) {
+                listBlocks.splice(listBlocks.begin(), listBlocks, it);
+                return it->pblock;
+            }
+        }
+        return boost::shared_ptr<const CBlock>();
+    }
+
+    void Insert(const uint256 &hash, const boost::shared_ptr<const CBlock> &pblock)
+    {
+        unsigned int nSize = ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+        LOCK(cs);
+        // Another thread may have read the same block meanwhile
+        for (std::list<CEntry>::iterator it = listBlocks.begin(); it != listBlocks.end(); it++)
+            if (it->hash == hash)
+                return;
+        CEntry entry;
+        entry.hash = hash;
+        entry.pblock = pblock;
+        entry.nSize = nSize;
+        listBlocks.push_front(entry);
+        nTotalSize += nSize;
+        while (nTotalSize > MAX_BLOCK_READ_CACHE_SIZE && listBlocks.size() > 1) {
+            nTotalSize -= listBlocks.back().nSize;
+            listBlocks.pop_back();
+        }
+    }
+};
+
+static CBlockReadCache blockreadcache;
+
+boost::shared_ptr<const CBlock> ReadBlockFromDiskCached(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    boost::shared_ptr<const CBlock> pblock = blockreadcache.Get(hash);
+    if (pblock)
+        return pblock;
+
+    boost::shared_ptr<CBlock> pblockNew(new CBlock());
+    if (!ReadBlockFromDisk(*pblockNew, pindex))
+        return boost::shared_ptr<const CBlock>();
+    blockreadcache.Insert(hash, pblockNew);
+    return pblockNew;
+}
+
 uint256 static GetOrphanRoot(const CBlockHeader* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -1347,9 +2020,7 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHead
     }
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < nInterval-1; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - (nInterval-1));
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1467,15 +2138,20 @@ void CheckForkWarningConditions()
 void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
 {
     // If we are on a fork that is sufficiently large, set a warning flag
-    CBlockIndex* pfork = pindexNewForkTip;
-    CBlockIndex* plonger = pindexBest;
-    while (pfork && pfork != plonger)
-    {
-        while (plonger && plonger->nHeight > pfork->nHeight)
+    CBlockIndex* pfork = NULL;
+    if (pindexBest) {
+        // Bring both to the same height through the skiplist, then step
+        // back together until they meet
+        CBlockIndex* plonger = pindexBest;
+        pfork = pindexNewForkTip;
+        if (plonger->nHeight > pfork->nHeight)
+            plonger = plonger->GetAncestor(pfork->nHeight);
+        else
+            pfork = pfork->GetAncestor(plonger->nHeight);
+        while (pfork != plonger) {
+            pfork = pfork->pprev;
             plonger = plonger->pprev;
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
+        }
     }
 
     // We define a condition which we should warn the user about as a fork of at least 7 blocks
@@ -1620,9 +2296,9 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     // mark inputs spent
     if (!tx.IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoins &coins = inputs.GetCoins(txin.prevout.hash);
+            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
             CTxInUndo undo;
-            assert(coins.Spend(txin.prevout, undo));
+            assert(coins->Spend(txin.prevout, undo));
             txundo.vprevout.push_back(undo);
         }
     }
@@ -1654,11 +2330,79 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pcache.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
 
+bool CCoinsPrefetch::operator()() {
+    // A failed lookup is not a validation failure; the entry is simply
+    // fetched again, serially, when the block is connected.
+    try {
+        presult->first = pview->GetCoins(txid, presult->second);
+    } catch (std::exception &e) {
+        presult->first = false;
+    }
+    return true;
+}
+
+// Collect the txids of the outputs a block spends that it does not create
+// itself, each once. The block must have passed CheckBlock, which caches its
+// transaction hashes. Returns the number of inputs.
+static unsigned int GetBlockInputTxids(const CBlock &block, std::vector<uint256> &vTxid)
+{
+    std::set<uint256> setCreated;
+    std::set<uint256> setSpent;
+    unsigned int nInputs = 0;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                nInputs++;
+                const uint256 &hash = txin.prevout.hash;
+                if (!setCreated.count(hash) && setSpent.insert(hash).second)
+                    vTxid.push_back(hash);
+            }
+        }
+        setCreated.insert(block.GetTxHash(i));
+    }
+    return nInputs;
+}
+
+bool CBlockCheck::operator()() {
+    // Failures are not reported here: a block that cannot be deserialized
+    // is skipped by the importer, and one that fails CheckBlock is checked
+    // again, with proper error reporting, by ProcessBlock.
+    // The destination block may be reused, so make sure nothing survives
+    // from its last contents.
+    pblock->SetNull();
+    *pfChecked = false;
+    try {
+        CDataStream ss(vData, SER_DISK, CLIENT_VERSION);
+        ss >> *pblock;
+        *pnSize = vData.size() - ss.size();
+    } catch (std::exception &e) {
+        pblock->SetNull();
+        *pnSize = 0;
+        return true;
+    }
+    CValidationState state;
+    if (!CheckBlock(*pblock, state))
+        return true;
+    *pfChecked = true;
+    if (pcoinswriter == NULL)
+        return true;
+    // Read the coins the block spends while the previous block is being
+    // connected, without cs_main, so connecting it finds them in memory
+    int64 nStart = GetTimeMicros();
+    std::vector<uint256> vTxid;
+    unsigned int nInputs = GetBlockInputTxids(*pblock, vTxid);
+    unsigned int nRead = pcoinswriter->Prefetch(vTxid);
+    if (fBenchmark)
+        LogPrintf("- Read ahead %u of %u txins: %.2fms\n", nRead, nInputs, 0.001 * (GetTimeMicros() - nStart));
+    return true;
+}
+
 bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
 {
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
@@ -1718,12 +2462,18 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Share the parts of the signature hashes that are common to all
+            // inputs between the checks of this transaction.
+            boost::shared_ptr<const CSignatureHashCache> pcache;
+            if (tx.vin.size() > 1)
+                pcache.reset(new CSignatureHashCache(tx));
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins &coins = inputs.GetCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, tx, i, flags, 0);
+                CScriptCheck check(coins, tx, i, flags, 0, pcache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1731,7 +2481,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, pcache);
                         if (check())
                             return state.Invalid();
                     }
@@ -1771,23 +2521,23 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // check that all outputs are available
-        if (!view.HaveCoins(hash)) {
-            fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
-            view.SetCoins(hash, CCoins());
+        {
+            CCoinsModifier outs = view.ModifyCoins(hash);
+            if (outs->IsPruned())
+                fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
+
+            CCoins outsBlock = CCoins(tx, pindex->nHeight);
+            // The CCoins serialization does not serialize negative numbers.
+            // No network rules currently depend on the version here, so an inconsistency is harmless
+            // but it must be corrected before txout nversion ever influences a network rule.
+            if (outsBlock.nVersion < 0)
+                outs->nVersion = outsBlock.nVersion;
+            if (*outs != outsBlock)
+                fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
+
+            // remove outputs
+            *outs = CCoins();
         }
-        CCoins &outs = view.GetCoins(hash);
-
-        CCoins outsBlock = CCoins(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs.nVersion = outsBlock.nVersion;
-        if (outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs = CCoins();
 
         // restore inputs
         if (i > 0) { // not coinbases
@@ -1858,13 +2608,46 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(16, MAX_SCRIPTCHECK_THREADS);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+static CCheckQueue<CBlockCheck> blockcheckqueue(1);
+// Held by the thread using blockcheckqueue, which takes a single master
+static boost::mutex mutexBlockCheck;
+
+void ThreadBlockCheck() {
+    RenameThread("bitcoin-blkcheck");
+    blockcheckqueue.Thread();
+}
+
+// Load the outputs spent by a block into the coins cache using the prefetch
+// threads, so ConnectBlock does not have to wait for the database serially.
+// Blocks from the importer have mostly been read ahead by CBlockCheck
+// already; this picks up the rest.
+// The block must have passed CheckBlock, which caches its transaction hashes.
+static void PrefetchBlockInputs(const CBlock &block)
+{
+    if (!nScriptCheckThreads)
+        return;
+    int64 nStart = GetTimeMicros();
+    std::vector<uint256> vTxid;
+    unsigned int nInputs = GetBlockInputTxids(block, vTxid);
+    unsigned int nFetched = pcoinsTip->Prefetch(vTxid, &prefetchqueue);
+    if (fBenchmark)
+        LogPrintf("- Prefetch %u of %u txins: %.2fms\n", nFetched, nInputs, 0.001 * (GetTimeMicros() - nStart));
+}
+
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in
@@ -1882,6 +2665,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         return true;
     }
 
+    if (!fJustCheck)
+        PrefetchBlockInputs(block);
+
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -1975,8 +2761,15 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     if (!control.Wait())
         return state.DoS(100, false);
     int64 nTime2 = GetTimeMicros() - nStart;
-    if (fBenchmark)
+    if (fBenchmark) {
         LogPrintf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+        if (fScriptChecks && nScriptCheckThreads) {
+            CCheckQueueStats stats = scriptcheckqueue.GetStats();
+            LogPrintf("- Script check queue: %u batches, %u checks stolen, lock contended %u times (%.2fms), waited %.2fms for other threads, %d other threads idle %.2fms (%.0f%%)\n",
+                      stats.nBatches, stats.nStolen, stats.nLockContended, 0.001 * stats.nLockWaitTime, 0.001 * stats.nMasterWaitTime,
+                      nScriptCheckThreads - 1, 0.001 * stats.nWorkerIdleTime, 100.0 * stats.nWorkerIdleTime / std::max((nScriptCheckThreads - 1) * nTime2, (int64)1));
+        }
+    }
 
     if (fJustCheck)
         return true;
@@ -2025,19 +2818,16 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // Only when all have succeeded, we push it to pcoinsTip.
     CCoinsViewCache view(*pcoinsTip, true);
 
-    // Find the fork (typically, there is none)
+    // Find the fork (typically, there is none). The current best block is
+    // the tip of the height index, so the fork is the first block of the
+    // new branch that is in it.
     CBlockIndex* pfork = view.GetBestBlock();
-    CBlockIndex* plonger = pindexNew;
-    while (pfork && pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight) {
-            plonger = plonger->pprev;
-            assert(plonger != NULL);
+    if (pfork) {
+        pfork = pindexNew;
+        while (!pfork->IsInMainChain()) {
+            pfork = pfork->pprev;
+            assert(pfork != NULL);
         }
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-        assert(pfork != NULL);
     }
 
     // List of what to disconnect (typically nothing)
@@ -2077,7 +2867,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<pair<uint256, CTransaction> > vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
         CBlock block;
         if (!ReadBlockFromDisk(block, pindex))
@@ -2093,9 +2883,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (fBenchmark)
             LogPrintf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
-        // Queue memory transactions to delete
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+        // Queue memory transactions to delete, with the hashes ConnectBlock
+        // already computed
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            vDelete.push_back(make_pair(block.GetTxHash(i), block.vtx[i]));
     }
 
     // Flush changes to global coin state
@@ -2108,22 +2899,36 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() + pcoinswriter->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetDirtyCacheSize()))
             return state.Error();
+        // The block files and the block index must be on disk before the
+        // coin database can refer to their blocks as its best block
         FlushBlockFile();
         pblocktree->Sync();
-        if (!pcoinsTip->Flush())
+        // Write out the modified coins, but keep the cache warm: only the
+        // least recently used entries are dropped, and only when over budget.
+        // Trimming to half the budget keeps flushes during IBD spaced out.
+        // The coin database itself is written in the background; it is
+        // updated atomically along with its best block, so a crash leaves
+        // it at an earlier, consistent state. The batch the writer holds is
+        // a copy of the dirty entries, and counts against the budget until
+        // it is written.
+        if (!pcoinsTip->Sync())
             return state.Abort(_("Failed to write to coin database"));
+        size_t nWriterUsage = pcoinswriter->DynamicMemoryUsage();
+        if (pcoinsTip->DynamicMemoryUsage() + nWriterUsage > nCoinCacheUsage)
+            pcoinsTip->Trim(nCoinCacheUsage / 2 - std::min(nCoinCacheUsage / 2, nWriterUsage));
     }
 
-    // At this point, all changes have been done to the database.
-    // Proceed by updating the memory structures.
+    // At this point, all changes have been done to the database (or are
+    // being written in the background). Proceed by updating the memory
+    // structures.
 
     // Register new best chain
     vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
@@ -2139,9 +2944,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     }
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
+    for (unsigned int i = 0; i < vDelete.size(); i++) {
+        mempool.remove(vDelete[i].first, vDelete[i].second);
+        mempool.removeConflicts(vDelete[i].second);
     }
 
     mempool.check(pcoinsTip);
@@ -2156,7 +2961,6 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
@@ -2204,15 +3008,16 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = blockindexarena.New();
+    *pindexNew = CBlockIndex(block);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
@@ -2373,10 +3178,10 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         if (!CheckTransaction(tx, state))
             return error("CheckBlock() : CheckTransaction failed");
 
-    // Build the merkle tree already. We need it anyway later, and it makes the
-    // block cache the transaction hashes, which means they don't need to be
-    // recalculated many times during this block's validation.
-    block.BuildMerkleTree();
+    // Compute the merkle root already. We need it anyway later, and it makes
+    // the block cache the transaction hashes, which means they don't need to
+    // be recalculated many times during this block's validation.
+    uint256 hashMerkleRoot = block.ComputeMerkleRoot();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2396,7 +3201,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && block.hashMerkleRoot != block.vMerkleTree.back())
+    if (fCheckMerkleRoot && block.hashMerkleRoot != hashMerkleRoot)
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
@@ -2413,7 +3218,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != Params().HashGenesisBlock()) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2490,6 +3295,55 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     return true;
 }
 
+// Turn the lowest set bit of n off
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height the skip pointer of a block at this height points to
+static inline int GetSkipHeight(int height)
+{
+    if (height < 2)
+        return 0;
+    // Determine which height to jump back to. Any number strictly lower than
+    // height is acceptable, but the following expression seems to perform
+    // well in simulations (max 110 steps to go back up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 && heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     unsigned int nFound = 0;
@@ -2513,7 +3367,7 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2523,7 +3377,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!CheckBlock(*pblock, state))
+    if (!fChecked && !CheckBlock(*pblock, state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -2812,43 +3666,215 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockindexarena.New();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+static boost::filesystem::path GetBlockIndexSnapshotPath()
 {
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
 
-    boost::this_thread::interruption_point();
+// Snapshot entries are in height order, so that each can refer to its
+// parent by position. Along with the fields of CDiskBlockIndex, they hold
+// the block hash and chain work, which are slow to compute. The header
+// records the best block of the coin database and the files of the block
+// tree database as closed, which the loader compares with the databases as
+// found.
+bool PrepareBlockIndexSnapshot(CDataStream &ss)
+{
+    // Do not save an index that is only partially loaded
+    if (!fBlockIndexLoaded)
+        return false;
 
-    // Calculate nChainWork
+    int64 nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
-            setBlockIndexValid.insert(pindex);
+
+    uint256 hashSnapshot = GetRandHash();
+    CBlockIndex* pindexCoins = pcoinsTip->GetBestBlock();
+    uint256 hashCoinsBest = pindexCoins ? pindexCoins->GetBlockHash() : uint256(0);
+    unsigned int nCount = vSortedByHeight.size();
+    ss.reserve(nCount * 128);
+    ss << hashSnapshot << hashCoinsBest << VARINT(nCount);
+    boost::unordered_map<const CBlockIndex*, unsigned int> mapPos;
+    for (unsigned int i = 0; i < nCount; i++) {
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        unsigned int nPrev = 0; // position of the parent plus one, 0 for none
+        if (pindex->pprev) {
+            boost::unordered_map<const CBlockIndex*, unsigned int>::const_iterator it = mapPos.find(pindex->pprev);
+            if (it == mapPos.end())
+                return error("PrepareBlockIndexSnapshot() : parent of %s missing", pindex->GetBlockHash().ToString().c_str());
+            nPrev = it->second + 1;
+        }
+        mapPos[pindex] = i;
+        ss << pindex->GetBlockHash() << VARINT(nPrev);
+        ss << VARINT(pindex->nHeight) << VARINT(pindex->nStatus) << VARINT(pindex->nTx);
+        if (pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
+            ss << VARINT(pindex->nFile);
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            ss << VARINT(pindex->nDataPos);
+        if (pindex->nStatus & BLOCK_HAVE_UNDO)
+            ss << VARINT(pindex->nUndoPos);
+        ss << pindex->nVersion << pindex->hashMerkleRoot << pindex->nTime << pindex->nBits << pindex->nNonce;
+        ss << pindex->nChainWork;
+    }
+
+    // The file is only written once the database is closed, but it cannot
+    // be used unless it has this id
+    if (!pblocktree->WriteIndexSnapshot(hashSnapshot))
+        return error("PrepareBlockIndexSnapshot() : failed to write snapshot id");
+    LogPrintf("Prepared block index snapshot of %u entries in %"PRI64d"ms\n", nCount, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool WriteBlockIndexSnapshot(const CDataStream &ss)
+{
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << FLATDATA(Params().MessageStart()) << GetLevelDBFilesHash(GetDataDir() / "blocks" / "index");
+    uint256 hash = Hash(ssHeader.begin(), ssHeader.end(), ss.begin(), ss.end());
+
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = path.string() + strprintf(".%04x", (unsigned int)GetRand(0x10000));
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    try {
+        fileout << ssHeader << ss << hash;
+    } catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("WriteBlockIndexSnapshot() : rename-into-place failed");
+    return true;
+}
+
+// Load mapBlockIndex from the snapshot written at the last shutdown. This
+// fails, leaving the index empty, unless the block tree database still has
+// the id of the snapshot, which is removed whenever the index may change.
+// Versions without snapshots leave the id in place, so the block tree
+// database's files must also be as they were when it was closed, and the
+// coin database must still be at the best block the snapshot was written
+// with.
+bool static LoadBlockIndexSnapshot()
+{
+    uint256 hashSnapshot;
+    if (!pblocktree->ReadIndexSnapshot(hashSnapshot))
+        return false;
+    // From now on the block index can change, so never use this snapshot again
+    if (!pblocktree->EraseIndexSnapshot())
+        return false;
+
+    int64 nStart = GetTimeMillis();
+    bool fOk = false;
+    try {
+        boost::interprocess::file_mapping mapping(GetBlockIndexSnapshotPath().string().c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+        const char *pbegin = (const char*)region.get_address();
+        if (region.get_size() < sizeof(uint256))
+            throw std::runtime_error("file too short");
+        const char *pend = pbegin + region.get_size() - sizeof(uint256);
+        uint256 hashChecksum;
+        memcpy(hashChecksum.begin(), pend, sizeof(hashChecksum));
+        if (Hash(pbegin, pend) != hashChecksum)
+            throw std::runtime_error("checksum mismatch");
+
+        CBufferReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+        unsigned char pchMessageStart[4];
+        uint256 hashFiles, hashIn, hashCoinsBest;
+        unsigned int nCount = 0;
+        reader >> FLATDATA(pchMessageStart) >> hashFiles >> hashIn >> hashCoinsBest >> VARINT(nCount);
+        if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)) != 0 || hashIn != hashSnapshot)
+            throw std::runtime_error("snapshot does not belong to this block index");
+        if (hashFiles != pblocktree->GetFilesHashAtOpen())
+            throw std::runtime_error("block tree database was opened since");
+
+        mapBlockIndex.rehash(nCount);
+        vector<CBlockIndex*> vIndex;
+        vIndex.reserve(nCount);
+        for (unsigned int i = 0; i < nCount; i++) {
+            uint256 hash;
+            unsigned int nPrev = 0;
+            reader >> hash >> VARINT(nPrev);
+            if (nPrev > i)
+                throw std::runtime_error("parent out of order");
+            CBlockIndex* pindex = InsertBlockIndex(hash);
+            pindex->pprev = nPrev ? vIndex[nPrev - 1] : NULL;
+            reader >> VARINT(pindex->nHeight) >> VARINT(pindex->nStatus) >> VARINT(pindex->nTx);
+            if (pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO))
+                reader >> VARINT(pindex->nFile);
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                reader >> VARINT(pindex->nDataPos);
+            if (pindex->nStatus & BLOCK_HAVE_UNDO)
+                reader >> VARINT(pindex->nUndoPos);
+            reader >> pindex->nVersion >> pindex->hashMerkleRoot >> pindex->nTime >> pindex->nBits >> pindex->nNonce;
+            reader >> pindex->nChainWork;
+
+            pindex->BuildSkip();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+            if (pindexGenesisBlock == NULL && hash == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindex;
+            vIndex.push_back(pindex);
+        }
+        if (!reader.empty())
+            throw std::runtime_error("trailing data");
+        // Only now can the coin database's best block be looked up
+        CBlockIndex* pindexCoins = pcoinswriter->GetBestBlock();
+        if ((pindexCoins ? pindexCoins->GetBlockHash() : uint256(0)) != hashCoinsBest)
+            throw std::runtime_error("coin database has moved to another block since");
+        fOk = true;
+        LogPrintf("LoadBlockIndexSnapshot() : loaded %u entries in %"PRI64d"ms\n", nCount, GetTimeMillis() - nStart);
+    } catch (std::exception &e) {
+        LogPrintf("LoadBlockIndexSnapshot() : cannot use snapshot: %s\n", e.what());
+    }
+    if (!fOk)
+        UnloadBlockIndex();
+    return fOk;
+}
+
+bool static LoadBlockIndexDB()
+{
+    // Scanning the database is only needed if there is no valid snapshot
+    if (!LoadBlockIndexSnapshot()) {
+        if (!pblocktree->LoadBlockIndexGuts())
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        // Calculate nChainWork
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->BuildSkip();
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+        }
     }
 
     // Load block file info
@@ -2931,8 +3957,9 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
                     return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
             }
         }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks.
+        // The bound is in entries, as when -dbcache was converted at 300 bytes per entry.
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2 * nCoinCacheUsage / 300 + 32000) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2968,7 +3995,13 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 
 void UnloadBlockIndex()
 {
+    // A pending coins write may still refer to the entries about to be freed
+    if (pcoinswriter)
+        pcoinswriter->UnloadBlockIndex();
+    fBlockIndexLoaded = false;
     mapBlockIndex.clear();
+    vBlockIndexByHeight.clear();
+    blockindexarena.Clear();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2978,6 +4011,11 @@ void UnloadBlockIndex()
     pindexBest = NULL;
 }
 
+bool WaitForCoinsWriter()
+{
+    return pcoinswriter == NULL || pcoinswriter->Wait();
+}
+
 bool LoadBlockIndex()
 {
     // Load block index from databases
@@ -2989,8 +4027,10 @@ bool LoadBlockIndex()
 
 bool InitBlockIndex() {
     // Check whether we're already initialized
-    if (pindexGenesisBlock != NULL)
+    if (pindexGenesisBlock != NULL) {
+        fBlockIndexLoaded = true;
         return true;
+    }
 
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
@@ -3016,6 +4056,7 @@ bool InitBlockIndex() {
         }
     }
 
+    fBlockIndexLoaded = true;
     return true;
 }
 
@@ -3025,7 +4066,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3091,6 +4132,48 @@ void PrintBlockTree()
     }
 }
 
+// Locate the next block in an external block file, and read its serialized
+// data. On success, nRewind still points just past the block's header, so a
+// caller that fails to deserialize the data can resume scanning from there.
+static bool ReadExternalBlock(CBufferedFile &blkdat, uint64 &nRewind, uint64 &nBlockPos, std::vector<char> &vData)
+{
+    while (blkdat.good() && !blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[4];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), 4))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (std::exception &e) {
+            // no valid block header found; don't complain
+            return false;
+        }
+        try {
+            // read block
+            nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            vData.resize(nSize);
+            blkdat.read(&vData[0], nSize);
+            return true;
+        } catch (std::exception &e) {
+            LogPrintf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+    }
+    return false;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
@@ -3108,50 +4191,60 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             }
         }
         uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[4];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), 4))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
+        // Blocks are processed in a pipeline: while one is being accepted
+        // and connected under cs_main, the next one is deserialized, checked
+        // by CheckBlock and has its inputs read ahead on the block check
+        // thread. ProcessBlock is then told that block was already checked.
+        CBlock blocks[2];
+        uint64 nBlockPos[2] = {0, 0};
+        unsigned int nBlockSize[2] = {0, 0};
+        bool fChecked[2] = {false, false};
+        int nCur = 0;
+        bool fMore = true;
+        while (fMore) {
+            CBlock &block = blocks[nCur];
+            CBlock &blockNext = blocks[1 - nCur];
+            std::vector<char> vData;
+            nBlockSize[1 - nCur] = 0;
+            fMore = ReadExternalBlock(blkdat, nRewind, nBlockPos[1 - nCur], vData);
+
+            boost::unique_lock<boost::mutex> lockCheck(mutexBlockCheck);
+            CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+            std::vector<CBlockCheck> vChecks;
+            if (fMore) {
+                vChecks.push_back(CBlockCheck());
+                CBlockCheck check(vData, blockNext, nBlockSize[1 - nCur], fChecked[1 - nCur]);
+                check.swap(vChecks.back());
+                control.Add(vChecks);
             }
-            try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // process block
-                if (nBlockPos >= nStartByte) {
+
+            // process block
+            if (nBlockSize[nCur] > 0 && nBlockPos[nCur] >= nStartByte) {
+                try {
                     LOCK(cs_main);
                     if (dbp)
-                        dbp->nPos = nBlockPos;
+                        dbp->nPos = nBlockPos[nCur];
                     CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
+                    if (ProcessBlock(state, NULL, &block, dbp, fChecked[nCur]))
                         nLoaded++;
                     if (state.IsError())
                         break;
+                } catch (std::exception &e) {
+                    LogPrintf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
                 }
-            } catch (std::exception &e) {
-                LogPrintf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+            // The check result only holds for the block as it was checked
+            fChecked[nCur] = false;
+
+            control.Wait();
+
+            if (fMore) {
+                nCur = 1 - nCur;
+                if (nBlockSize[nCur] > 0)
+                    nRewind = nBlockPos[nCur] + nBlockSize[nCur];
+                else
+                    LogPrintf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
         }
         fclose(fileIn);
@@ -3289,11 +4382,13 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                boost::shared_ptr<const CBlock> pblock;
                 if (mi != mapBlockIndex.end())
+                    pblock = ReadBlockFromDiskCached((*mi).second);
+                if (pblock)
                 {
-                    CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
+                    const CBlock &block = *pblock;
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
                     else // MSG_FILTERED_BLOCK)
@@ -3378,7 +4473,9 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+// pblockChecked, if not NULL, is the block a "block" message holds, already
+// deserialized and checked by CBlockCheck
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, CBlock* pblockChecked)
 {
     RandAddSeedPerfmon();
     LogPrint("net", "received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
@@ -3688,7 +4785,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3728,7 +4825,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         bool fMissingInputs = false;
         CValidationState state;
-        if (mempool.accept(state, tx, true, &fMissingInputs))
+        if (mempool.accept(state, tx, inv.hash, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx, inv.hash);
@@ -3752,7 +4849,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     // anyone relaying LegitTxX banned)
                     CValidationState stateDummy;
 
-                    if (mempool.accept(stateDummy, orphanTx, true, &fMissingInputs2))
+                    if (mempool.accept(stateDummy, orphanTx, orphanHash, true, &fMissingInputs2))
                     {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString().c_str());
                         RelayTransaction(orphanTx, orphanHash);
@@ -3775,7 +4872,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(inv.hash, tx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
@@ -3790,8 +4887,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
-        CBlock block;
-        vRecv >> block;
+        CBlock blockRecv;
+        CBlock &block = pblockChecked ? *pblockChecked : blockRecv;
+        if (!pblockChecked)
+            vRecv >> block;
 
         LogPrint("net", "received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
@@ -3800,7 +4899,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->AddInventoryKnown(inv);
 
         CValidationState state;
-        if (ProcessBlock(state, pfrom, &block))
+        if (ProcessBlock(state, pfrom, &block, NULL, pblockChecked != NULL))
             mapAlreadyAskedFor.erase(inv);
         int nDoS;
         if (state.IsInvalid(nDoS))
@@ -3968,6 +5067,16 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    // Consecutive block messages are pipelined like the importer's blocks:
+    // while one is processed under cs_main, the next one is deserialized and
+    // checked on the block check thread. It is only used for the message it
+    // was read from.
+    CBlock blocks[2];
+    unsigned int nBlockSize = 0;
+    bool fBlockChecked[2] = {false, false};
+    int nCur = 0;
+    const CNetMessage* pmsgChecked = NULL;
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
@@ -4023,13 +5132,34 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        CBlock* pblockChecked = NULL;
+        if (&msg == pmsgChecked && fBlockChecked[nCur])
+            pblockChecked = &blocks[nCur];
+        fBlockChecked[nCur] = false;
+        pmsgChecked = NULL;
+
+        // Start checking the next message if it is a complete block too,
+        // unless the importer is using the block check thread
+        boost::unique_lock<boost::mutex> lockCheck(mutexBlockCheck, boost::defer_lock);
+        bool fCheckNext = strCommand == "block" && !fImporting && !fReindex &&
+                          it != pfrom->vRecvMsg.end() && it->complete() && it->hdr.IsValid() &&
+                          it->hdr.GetCommand() == "block" && lockCheck.try_lock();
+        CCheckQueueControl<CBlockCheck> control(fCheckNext ? &blockcheckqueue : NULL);
+        if (fCheckNext) {
+            std::vector<char> vData(it->vRecv.begin(), it->vRecv.end());
+            std::vector<CBlockCheck> vChecks(1);
+            CBlockCheck check(vData, blocks[1 - nCur], nBlockSize, fBlockChecked[1 - nCur]);
+            check.swap(vChecks.back());
+            control.Add(vChecks);
+        }
+
         // Process message
         bool fRet = false;
         try
         {
             {
                 LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, pblockChecked);
             }
             boost::this_thread::interruption_point();
         }
@@ -4061,6 +5191,12 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        control.Wait();
+        if (fCheckNext) {
+            nCur = 1 - nCur;
+            pmsgChecked = &*it;
+        }
     }
 
     // In case the connection got shut down, its receive buffer was wiped
@@ -4251,10 +5387,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockindexarena.Clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -9,6 +9,7 @@
 #include "bitcoin-config.h"
 #endif
 
+#include "blockmap.h"
 #include "core.h"
 #include "bignum.h"
 #include "sync.h"
@@ -17,6 +18,12 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -45,6 +52,10 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** The number of blk?????.dat files kept memory-mapped for reading blocks */
+static const unsigned int MAX_MAPPED_BLOCKFILES = 8;
+/** The total serialized size of recently read blocks kept in memory */
+static const unsigned int MAX_BLOCK_READ_CACHE_SIZE = 8 * MAX_BLOCK_SIZE;
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 /** No amount larger than this (in satoshi) is valid */
@@ -73,7 +84,7 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::vector<CBlockIndex*> vBlockIndexByHeight;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern CBlockIndex* pindexGenesisBlock;
@@ -96,7 +107,7 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern bool fHaveGUI;
 
 // Settings
@@ -119,6 +130,8 @@ class CValidationState;
 
 struct CBlockTemplate;
 
+template<typename T> class CCheckQueue;
+
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWallet* pwalletIn);
 /** Unregister a wallet from core */
@@ -135,8 +148,9 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block. fChecked means CheckBlock was just run on the
+ *  block as it is (by CBlockCheck), and passed, so it is not run again. */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -151,6 +165,15 @@ bool InitBlockIndex();
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Wait until the coins flushed from pcoinsTip are written to the database.
+ *  Returns false if a write failed. */
+bool WaitForCoinsWriter();
+/** Serialize the block index for a flat file, which the next start can load
+ *  instead of scanning the block tree database, and mark the database as
+ *  matching it */
+bool PrepareBlockIndexSnapshot(CDataStream &ss);
+/** Save the prepared snapshot, once the block tree database is closed */
+bool WriteBlockIndexSnapshot(const CDataStream &ss);
 /** Verify consistency of the block and coin databases */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
 /** Print the loaded block tree */
@@ -163,6 +186,11 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the coins prefetch thread */
+void ThreadCoinsPrefetch();
+/** Run an instance of the block check thread, used by the block importer
+ *  and for consecutive block messages */
+void ThreadBlockCheck();
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
@@ -412,12 +440,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSignatureHashCache> pcache;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache> &pcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pcache(pcacheIn) { }
 
     bool operator()() const;
 
@@ -427,6 +457,64 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pcache.swap(check.pcache);
+    }
+};
+
+/** Closure representing the lookup of one transaction's unspent outputs in
+ *  a coins view that supports concurrent reads (the coins database).
+ *  Note that this stores a reference to the result slot */
+class CCoinsPrefetch
+{
+private:
+    CCoinsView *pview;
+    uint256 txid;
+    std::pair<bool, CCoins> *presult;
+
+public:
+    CCoinsPrefetch() : pview(NULL), presult(NULL) {}
+    CCoinsPrefetch(CCoinsView &viewIn, const uint256 &txidIn, std::pair<bool, CCoins> &resultIn) :
+        pview(&viewIn), txid(txidIn), presult(&resultIn) { }
+
+    bool operator()();
+
+    void swap(CCoinsPrefetch &prefetch) {
+        std::swap(pview, prefetch.pview);
+        std::swap(txid, prefetch.txid);
+        std::swap(presult, prefetch.presult);
+    }
+};
+
+/** Closure representing the context-free part of validating a serialized
+ *  block, from an external block file or a block message: deserializing
+ *  it, and running CheckBlock, which also builds its merkle tree and so
+ *  caches the transaction hashes. A block that passes then has the coins it
+ *  spends read ahead into pcoinswriter. The importer and the message
+ *  handler run this for the next block while the current one is being
+ *  connected, and hand fChecked on to ProcessBlock.
+ *  Note that this stores references to the destination block and results */
+class CBlockCheck
+{
+private:
+    std::vector<char> vData;
+    CBlock *pblock;
+    unsigned int *pnSize;
+    bool *pfChecked;
+
+public:
+    CBlockCheck() : pblock(NULL), pnSize(NULL), pfChecked(NULL) {}
+    CBlockCheck(std::vector<char> &vDataIn, CBlock &blockIn, unsigned int &nSizeIn, bool &fCheckedIn) :
+        pblock(&blockIn), pnSize(&nSizeIn), pfChecked(&fCheckedIn) {
+        vData.swap(vDataIn);
+    }
+
+    bool operator()();
+
+    void swap(CBlockCheck &check) {
+        vData.swap(check.vData);
+        std::swap(pblock, check.pblock);
+        std::swap(pnSize, check.pnSize);
+        std::swap(pfChecked, check.pfChecked);
     }
 };
 
@@ -584,6 +672,11 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block, or take it from the cache of recently read ones. Returns
+ *  NULL on failure. The block is shared with other threads, so do not call
+ *  anything on it that fills its memory-only fields (BuildMerkleTree,
+ *  ComputeMerkleRoot, CheckBlock). GetMerkleBranch only reads them. */
+boost::shared_ptr<const CBlock> ReadBlockFromDiskCached(const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -698,6 +791,9 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
+    // (memory only) pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -735,6 +831,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -755,6 +852,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -870,6 +968,15 @@ public:
     static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart,
                                 unsigned int nRequired, unsigned int nToCheck);
 
+    // Build the skiplist pointer for this entry. pprev must have its own
+    // already.
+    void BuildSkip();
+
+    // Efficiently find the ancestor of this block at the given height, on
+    // any branch, in O(log n) steps. Returns NULL if there is none.
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     std::string ToString() const
     {
         return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
@@ -1087,8 +1194,10 @@ public:
     std::map<COutPoint, CInPoint> mapNextTx;
 
     bool accept(CValidationState &state, const CTransaction &tx, bool fLimitFree, bool* pfMissingInputs);
+    bool accept(CValidationState &state, const CTransaction &tx, const uint256 &hash, bool fLimitFree, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
+    bool remove(const uint256 &hash, const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
@@ -1127,6 +1236,57 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** Salted hasher for txids, so that cache bucket placement cannot be predicted by peers. */
+class CCoinsKeyHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CCoinsKeyHasher();
+    size_t operator()(const uint256& key) const {
+        return key.GetHash(salt);
+    }
+};
+
+struct CCoinsCacheEntry
+{
+    CCoins coins; // The actual cached data.
+    unsigned char flags;
+    int nAccessHeight; // Height of the cache's best block when this entry was last used.
+
+    enum Flags {
+        DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
+        FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+    };
+
+    // The outputs the base view holds for this transaction, as of when this
+    // entry was last loaded from or written to it: bit n is set if output n
+    // is unspent there, and nStoredHeight is their height. Lets CCoinsViewDB
+    // write only what changed without reading its record back. Unknown if
+    // nStoredHeight is negative, e.g. for transactions with over 64 outputs.
+    uint64 nStoredMask;
+    int nStoredHeight;
+
+    CCoinsCacheEntry() : coins(), flags(0), nAccessHeight(0), nStoredMask(0), nStoredHeight(-1) {}
+
+    // Record that the base view now holds exactly these coins
+    void SetStored(const CCoins &coinsStored) {
+        nStoredMask = 0;
+        nStoredHeight = -1;
+        if (coinsStored.vout.size() > 64)
+            return;
+        for (unsigned int i = 0; i < coinsStored.vout.size(); i++)
+            if (!coinsStored.vout[i].IsNull())
+                nStoredMask |= (uint64)1 << i;
+        nStoredHeight = coinsStored.nHeight;
+    }
+
+    bool IsStoredKnown() const { return nStoredHeight >= 0; }
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -1147,8 +1307,10 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // Only entries marked DIRTY need to be written.
+    // The passed mapCoins can be modified (entries may be swapped out instead of copied).
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -1171,19 +1333,54 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
+class CCoinsViewCache;
+
+/** A reference to a mutable cache entry. Encapsulating it allows us to run
+ *  cleanup code after the modification is finished, and keeping track of
+ *  concurrent modifications. */
+class CCoinsModifier
+{
+private:
+    CCoinsViewCache& cache;
+    CCoinsMap::iterator it;
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
+
+public:
+    CCoins* operator->() { return &it->second.coins; }
+    CCoins& operator*() { return it->second.coins; }
+    ~CCoinsModifier();
+    friend class CCoinsViewCache;
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Cached dynamic memory usage of the CCoins objects in cacheCoins
+    size_t cachedCoinsUsage;
+
+    // Number of entries in cacheCoins that are marked DIRTY
+    unsigned int nDirtyEntries;
+
+    // Keys of the entries marked DIRTY since the last Sync or Flush, so Sync
+    // does not have to scan the whole cache. May also hold keys of entries
+    // that were erased since, or listed twice.
+    std::vector<uint256> vDirtyKeys;
+
+    // Whether a CCoinsModifier for an entry of this cache is outstanding
+    bool hasModifier;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
+    ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins);
@@ -1191,20 +1388,47 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
-    // Return a modifiable reference to a CCoins. Check HaveCoins first.
+    // Return a reference to a CCoins in the cache. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
     // copying.
-    CCoins &GetCoins(const uint256 &txid);
+    const CCoins &GetCoins(const uint256 &txid);
 
-    // Push the modifications applied to this cache to its base.
-    // Failure to call this method before destruction will cause the changes to be forgotten.
+    // Return a modifiable reference to a CCoins. If no entry with the given
+    // txid exists, a new one is created. Simultaneous modifications are not
+    // allowed. The entry is marked DIRTY; if it ends up pruned while FRESH,
+    // it is dropped from the cache altogether.
+    CCoinsModifier ModifyCoins(const uint256 &txid);
+
+    // Push the modifications applied to this cache to its base, and empty the cache.
+    // Failure to call this method (or Sync) before destruction will cause the changes to be forgotten.
     bool Flush();
 
+    // Push the modifications applied to this cache to its base, but keep all
+    // entries in memory (as non-dirty), so subsequent lookups do not have to
+    // go back to the base.
+    bool Sync();
+
+    // Evict the least recently used non-dirty entries until the cache uses at
+    // most nMaxUsage bytes (or only dirty entries are left).
+    void Trim(size_t nMaxUsage);
+
+    // Load the entries for the given txids that are not cached yet from the
+    // base view, performing the lookups in parallel on pqueue's threads. The
+    // base view must support concurrent reads. Without a queue, the lookups are
+    // done serially. Returns the number of lookups done.
+    unsigned int Prefetch(const std::vector<uint256> &vTxid, CCheckQueue<CCoinsPrefetch> *pqueue);
+
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Number of cached transactions that need to be written by the next flush
+    unsigned int GetDirtyCacheSize() const;
+
+    // Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** Amount of bitcoins coming in to a transaction
         Note that lightweight clients may not know anything besides the hash of previous transactions,
         so may not be able to calculate this.
@@ -1220,8 +1444,79 @@ public:
 
     const CTxOut &GetOutputFor(const CTxIn& input);
 
+    friend class CCoinsModifier;
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    int GetAccessHeight() const;
+};
+
+/** CCoinsView that writes batches to its base on a background thread, so
+ *  that flushing a cache into it does not block the caller. One batch is
+ *  written at a time, and until it is, lookups are answered from it first.
+ *  The base must support concurrent reads and writes, and must not modify
+ *  the map given to BatchWrite; CCoinsViewDB does both. Once a write fails,
+ *  every later write fails too. */
+class CCoinsViewBackgroundWriter : public CCoinsViewBacked
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    // The batch being written, the best block it sets, and its memory usage
+    CCoinsMap mapWriting;
+    CBlockIndex *pindexWriting;
+    size_t nWritingUsage;
+
+    // Coins read ahead by the latest call to Prefetch, and by the one
+    // before, with their memory usage. Lookups take entries out, and writes
+    // drop the entries they make stale.
+    std::map<uint256, CCoins> mapPrefetched[2];
+    size_t nPrefetchedUsage[2];
+
+    // Number of writes queued so far, to detect reads a write made stale
+    unsigned int nWrites;
+
+    bool fWriting; // whether mapWriting is still to be written
+    bool fFailed;  // whether a write failed
+    bool fStop;    // whether the thread should exit when done writing
+
+    boost::thread_group threadGroup;
+
+    void ThreadWrite();
+
+    // Take the prefetched entry for txid out, if any (mutex must be held)
+    bool TakePrefetched(const uint256 &txid, CCoins &coins);
+    // Drop the prefetched entry for txid, if any (mutex must be held)
+    void ErasePrefetched(const uint256 &txid);
+
+public:
+    CCoinsViewBackgroundWriter(CCoinsView &baseIn);
+    ~CCoinsViewBackgroundWriter();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+
+    // Wait until the pending batch, if any, is written. Returns false if a
+    // write failed.
+    bool Wait();
+
+    // Memory used by the pending batch and the prefetched coins (in bytes)
+    size_t DynamicMemoryUsage();
+
+    // Read the coins for the given txids from the base ahead of time, for a
+    // block about to be connected. Unlike a cache on top of this view, this
+    // does not need cs_main. Returns the number of coins read.
+    unsigned int Prefetch(const std::vector<uint256> &vTxid);
+
+    // Wait for the pending batch, and forget the block index entry it sets
+    // as best block, as the block index is about to be unloaded
+    void UnloadBlockIndex();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -1240,6 +1535,10 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the writer of the coins database below
+    pcoinsTip, if any (protected by cs_main) */
+extern CCoinsViewBackgroundWriter *pcoinswriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
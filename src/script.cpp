@@ -4,19 +4,21 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "script.h"
 #include "core.h"
+#include "hash.h"
 #include "keystore.h"
-#include "bignum.h"
 #include "key.h"
 #include "sync.h"
 #include "util.h"
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *pcache = NULL);
 
 
 
@@ -24,20 +26,8 @@ typedef vector<unsigned char> valtype;
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
 
 bool CastToBool(const valtype& vch)
 {
@@ -69,6 +59,34 @@ static inline void popstack(vector<valtype>& stack)
     stack.pop_back();
 }
 
+// Push an empty element and return it. When the stack needs to grow, its
+// elements are swapped into the new storage instead of being copied one by
+// one (with a heap allocation each) as std::vector would do.
+static inline valtype& pushstack(vector<valtype>& stack)
+{
+    if (stack.size() == stack.capacity())
+    {
+        vector<valtype> stackNew;
+        stackNew.reserve(std::max(stack.capacity() * 2, (size_t)16));
+        stackNew.resize(stack.size());
+        for (unsigned int i = 0; i < stack.size(); i++)
+            stackNew[i].swap(stack[i]);
+        stack.swap(stackNew);
+    }
+    stack.push_back(valtype());
+    return stack.back();
+}
+
+// Push a copy of the element at the given (negative) offset from the top
+static inline void pushcopy(vector<valtype>& stack, int i)
+{
+    if (i >= 0 || (int)stack.size() + i < 0)
+        throw runtime_error("pushcopy() : out of range");
+    unsigned int nPos = stack.size() + i;
+    valtype& vch = pushstack(stack);
+    vch = stack[nPos];
+}
+
 
 const char* GetTxnOutputType(txnouttype t)
 {
@@ -300,9 +318,8 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
@@ -350,7 +367,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 return false; // Disabled opcodes.
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                pushstack(stack) = vchPushValue;
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -376,8 +393,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
+                    pushstack(stack) = bn.getvch();
                 }
                 break;
 
@@ -453,7 +470,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (stack.size() < 1)
                         return false;
-                    altstack.push_back(stacktop(-1));
+                    pushstack(altstack).swap(stacktop(-1));
                     popstack(stack);
                 }
                 break;
@@ -462,7 +479,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (altstack.size() < 1)
                         return false;
-                    stack.push_back(altstacktop(-1));
+                    pushstack(stack).swap(altstacktop(-1));
                     popstack(altstack);
                 }
                 break;
@@ -482,10 +499,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    pushcopy(stack, -2);
+                    pushcopy(stack, -2);
                 }
                 break;
 
@@ -494,12 +509,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    pushcopy(stack, -3);
+                    pushcopy(stack, -3);
+                    pushcopy(stack, -3);
                 }
                 break;
 
@@ -508,10 +520,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    pushcopy(stack, -4);
+                    pushcopy(stack, -4);
                 }
                 break;
 
@@ -520,11 +530,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
-                    stack.erase(stack.end()-6, stack.end()-4);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    rotate(stack.end()-6, stack.end()-4, stack.end());
                 }
                 break;
 
@@ -543,17 +549,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    if (CastToBool(stacktop(-1)))
+                        pushcopy(stack, -1);
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stack.size());
+                    pushstack(stack) = bn.getvch();
                 }
                 break;
 
@@ -571,8 +576,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    pushcopy(stack, -1);
                 }
                 break;
 
@@ -581,7 +585,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2)
                     if (stack.size() < 2)
                         return false;
-                    stack.erase(stack.end() - 2);
+                    swap(stacktop(-2), stacktop(-1));
+                    popstack(stack);
                 }
                 break;
 
@@ -590,8 +595,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    pushcopy(stack, -2);
                 }
                 break;
 
@@ -602,14 +606,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
-                        stack.erase(stack.end()-n-1);
-                    stack.push_back(vch);
+                        rotate(stack.end()-n-1, stack.end()-n, stack.end());
+                    else
+                        pushcopy(stack, -n-1);
                 }
                 break;
 
@@ -639,8 +643,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.insert(stack.end()-2, vch);
+                    pushcopy(stack, -1);
+                    swap(stacktop(-3), stacktop(-2));
                 }
                 break;
 
@@ -650,8 +654,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stacktop(-1).size());
+                    pushstack(stack) = bn.getvch();
                 }
                 break;
 
@@ -675,8 +679,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     //if (opcode == OP_NOTEQUAL)
                     //    fEqual = !fEqual;
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    stacktop(-1) = fEqual ? vchTrue : vchFalse;
                     if (opcode == OP_EQUALVERIFY)
                     {
                         if (fEqual)
@@ -701,7 +704,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
                     case OP_1ADD:       bn += bnOne; break;
@@ -712,8 +715,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
                     default:            assert(!"invalid opcode"); break;
                     }
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stacktop(-1) = bn.getvch();
                 }
                 break;
 
@@ -734,9 +736,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -761,8 +763,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stacktop(-1) = bn.getvch();
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -779,14 +780,13 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fValue ? vchTrue : vchFalse);
+                    stacktop(-1) = fValue ? vchTrue : vchFalse;
                 }
                 break;
 
@@ -821,8 +821,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         uint256 hash = Hash(vch.begin(), vch.end());
                         memcpy(&vchHash[0], &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    stacktop(-1).swap(vchHash);
                 }
                 break;
 
@@ -854,11 +853,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stacktop(-1) = fSuccess ? vchTrue : vchFalse;
                     if (opcode == OP_CHECKSIGVERIFY)
                     {
                         if (fSuccess)
@@ -878,7 +876,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -889,7 +887,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -915,7 +913,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                         if (fOk) {
                             isig++;
@@ -930,9 +928,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                             fSuccess = false;
                     }
 
-                    while (i-- > 0)
+                    // Leave the result in place of the last of the i elements
+                    while (i-- > 1)
                         popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stacktop(-1) = fSuccess ? vchTrue : vchFalse;
 
                     if (opcode == OP_CHECKMULTISIGVERIFY)
                     {
@@ -1034,68 +1033,243 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+CSignatureHashCache::CSignatureHashCache(const CTransaction &txTo)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    CDataStream ssInputs(SER_GETHASH, 0);
+    vMidstate.reserve(txTo.vin.size());
+    BOOST_FOREACH(const CTxIn &txin, txTo.vin) {
+        vMidstate.push_back(ss.GetMidstate());
+        ss << txin.prevout << CScript() << txin.nSequence;
+        ssInputs << txin.prevout << CScript() << txin.nSequence;
+    }
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+uint256 CSignatureHashCache::SignatureHash(CScript scriptCode, const CTransaction &txTo, unsigned int nIn, int nHashType) const
+{
+    // Only SIGHASH_ALL signs all inputs and outputs unmodified
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY) ||
+        nIn >= vMidstate.size())
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Every input with an empty scriptSig serializes to the same size
+    size_t nInputSize = vchInputs.size() / vMidstate.size();
+    const CTxIn &txin = txTo.vin[nIn];
+
+    CHashWriter ss(SER_GETHASH, 0, vMidstate[nIn]);
+    ss << txin.prevout << scriptCode << txin.nSequence;
+    ss.write(&vchInputs[0] + nInputSize * (nIn + 1), nInputSize * (vMidstate.size() - nIn - 1));
+    ss.write(&vchOutputs[0], vchOutputs.size());
+    ss << nHashType;
+    return ss.GetHash();
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Instead of the (signature hash, signature, public key) triples themselves,
+// only a salted SHA256 hash of them is stored, in a fixed-size table in which
+// every entry can live in one of a few slots determined by its value. The
+// salt is secret, so an attacker can neither predict where entries end up
+// nor which ones get evicted.
+//
+// Lookups do not take any lock, as they are done for every signature by all
+// script verification threads. Insertions are serialized among themselves,
+// but may overwrite a slot while it is being read. Each slot therefore has a
+// sequence number that is odd while the slot is being written and changes
+// with every write (a seqlock). A reader only reports a match if the
+// sequence number was even and unchanged around reading the entry, so it
+// never acts on a mix of two entries. All fields are accessed with the
+// compiler's atomic builtins, so concurrent access is well defined. Compilers
+// without them make lookups take the lock instead.
+
+#if defined(__ATOMIC_ACQUIRE)
+// GCC 4.7 and later, clang
+#define SIGCACHE_LOCK_FREE
+static inline unsigned int AtomicLoadAcquire(const unsigned int *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline unsigned int AtomicLoadRelaxed(const unsigned int *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+static inline void AtomicStoreRelaxed(unsigned int *p, unsigned int n) { __atomic_store_n(p, n, __ATOMIC_RELAXED); }
+static inline void AtomicStoreRelease(unsigned int *p, unsigned int n) { __atomic_store_n(p, n, __ATOMIC_RELEASE); }
+static inline void AtomicFenceAcquire() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+static inline void AtomicFenceRelease() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+#elif defined(__GNUC__)
+// Older GCC: aligned word accesses are atomic on all supported platforms,
+// and __sync_synchronize is a full barrier
+#define SIGCACHE_LOCK_FREE
+static inline unsigned int AtomicLoadAcquire(const unsigned int *p) { unsigned int n = *(volatile const unsigned int*)p; __sync_synchronize(); return n; }
+static inline unsigned int AtomicLoadRelaxed(const unsigned int *p) { return *(volatile const unsigned int*)p; }
+static inline void AtomicStoreRelaxed(unsigned int *p, unsigned int n) { *(volatile unsigned int*)p = n; }
+static inline void AtomicStoreRelease(unsigned int *p, unsigned int n) { __sync_synchronize(); *(volatile unsigned int*)p = n; }
+static inline void AtomicFenceAcquire() { __sync_synchronize(); }
+static inline void AtomicFenceRelease() { __sync_synchronize(); }
+#else
+// Lookups take cs_sigcache, so plain accesses will do
+static inline unsigned int AtomicLoadAcquire(const unsigned int *p) { return *p; }
+static inline unsigned int AtomicLoadRelaxed(const unsigned int *p) { return *p; }
+static inline void AtomicStoreRelaxed(unsigned int *p, unsigned int n) { *p = n; }
+static inline void AtomicStoreRelease(unsigned int *p, unsigned int n) { *p = n; }
+static inline void AtomicFenceAcquire() { }
+static inline void AtomicFenceRelease() { }
+#endif
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    // Number of slots an entry can be stored in
+    static const unsigned int nWays = 4;
+    static const unsigned int nWords = sizeof(uint256) / sizeof(unsigned int);
+
+    struct CSlot
+    {
+        unsigned int nSequence;
+        unsigned int vWords[nWords];
+    };
+
+    // SHA256 state after hashing the salt
+    SHA256_CTX ctxSalted;
+    // The table of entries, a null hash marking an empty slot
+    boost::scoped_array<CSlot> pTable;
+    size_t nSlots;
+    // Serializes insertions (and lookups, without SIGCACHE_LOCK_FREE)
+    mutable boost::mutex cs_sigcache;
+
+    void ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey, unsigned int *pEntry) const
+    {
+        SHA256_CTX ctx = ctxSalted;
+        unsigned int nSigSize = vchSig.size();
+        SHA256_Update(&ctx, hash.begin(), hash.size());
+        SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+        if (nSigSize)
+            SHA256_Update(&ctx, &vchSig[0], nSigSize);
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        SHA256_Final((unsigned char*)pEntry, &ctx);
+    }
+
+    CSlot &GetSlot(const unsigned int *pEntry, unsigned int nWay) const
+    {
+        return pTable[(((uint64)pEntry[2 * nWay + 1] << 32) | pEntry[2 * nWay]) % nSlots];
+    }
+
+    // Whether the slot holds the entry. Never true for a slot that is
+    // being written, or was written to while it was read.
+    static bool Match(const CSlot &slot, const unsigned int *pEntry)
+    {
+        unsigned int nSequence = AtomicLoadAcquire(&slot.nSequence);
+        if (nSequence & 1)
+            return false;
+        bool fMatch = true;
+        for (unsigned int i = 0; i < nWords; i++)
+            if (AtomicLoadRelaxed(&slot.vWords[i]) != pEntry[i])
+                fMatch = false;
+        AtomicFenceAcquire();
+        return fMatch && AtomicLoadRelaxed(&slot.nSequence) == nSequence;
+    }
+
+    // Only used with cs_sigcache held, when nothing else writes to the slot
+    static bool IsEmpty(const CSlot &slot)
+    {
+        for (unsigned int i = 0; i < nWords; i++)
+            if (AtomicLoadRelaxed(&slot.vWords[i]) != 0)
+                return false;
+        return true;
+    }
+
+    static void Write(CSlot &slot, const unsigned int *pEntry)
+    {
+        unsigned int nSequence = AtomicLoadRelaxed(&slot.nSequence);
+        AtomicStoreRelaxed(&slot.nSequence, nSequence + 1);
+        AtomicFenceRelease();
+        for (unsigned int i = 0; i < nWords; i++)
+            AtomicStoreRelaxed(&slot.vWords[i], pEntry[i]);
+        AtomicStoreRelease(&slot.nSequence, nSequence + 2);
+    }
 
 public:
+    CSignatureCache() : nSlots(0)
+    {
+        uint256 salt = GetRandHash();
+        SHA256_Init(&ctxSalted);
+        SHA256_Update(&ctxSalted, salt.begin(), salt.size());
+    }
+
+    // Not safe to call while other threads use the cache
+    void Resize(size_t nBytes)
+    {
+        nSlots = nBytes / sizeof(CSlot);
+        pTable.reset(nSlots ? new CSlot[nSlots]() : NULL);
+    }
+
     bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nSlots == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        unsigned int vEntry[nWords];
+        ComputeEntry(hash, vchSig, pubKey, vEntry);
+#ifndef SIGCACHE_LOCK_FREE
+        boost::unique_lock<boost::mutex> lock(cs_sigcache);
+#endif
+        for (unsigned int i = 0; i < nWays; i++)
+            if (Match(GetSlot(vEntry, i), vEntry))
+                return true;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nSlots == 0)
+            return;
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        unsigned int vEntry[nWords];
+        ComputeEntry(hash, vchSig, pubKey, vEntry);
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        boost::unique_lock<boost::mutex> lock(cs_sigcache);
+
+        for (unsigned int i = 0; i < nWays; i++) {
+            CSlot &slot = GetSlot(vEntry, i);
+            if (Match(slot, vEntry))
+                return;
+            if (IsEmpty(slot)) {
+                Write(slot, vEntry);
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // All slots are taken: evict one of them. Which one depends on the
+        // salted hash as well, so it is unpredictable to would-be DoS
+        // attackers who might try to pre-generate and re-use a set of valid
+        // signatures just-slightly-greater than our cache size.
+        Write(GetSlot(vEntry, vEntry[1] % nWays), vEntry);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+// Created by InitSignatureCache rather than during static initialization,
+// as the salt needs the random number generator. Until then, nothing is
+// cached.
+static boost::scoped_ptr<CSignatureCache> psignatureCache;
+
+void InitSignatureCache(size_t nBytes)
 {
-    static CSignatureCache signatureCache;
+    if (!psignatureCache)
+        psignatureCache.reset(new CSignatureCache());
+    psignatureCache->Resize(nBytes);
+}
 
+bool CheckSig(const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *pcache)
+{
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -1107,18 +1281,19 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         nHashType = vchSig.back();
     else if (nHashType != vchSig.back())
         return false;
-    vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = pcache ? pcache->SignatureHash(scriptCode, txTo, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // The signature cache is keyed on the signature including its hash type,
+    // so the signature only needs to be copied when it actually is verified.
+    if (psignatureCache && psignatureCache->Get(sighash, vchSig, pubkey))
         return true;
 
-    if (!pubkey.Verify(sighash, vchSig))
+    if (!pubkey.Verify(sighash, vector<unsigned char>(vchSig.begin(), vchSig.end() - 1)))
         return false;
 
-    if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+    if (psignatureCache && !(flags & SCRIPT_VERIFY_NOCACHE))
+        psignatureCache->Set(sighash, vchSig, pubkey);
 
     return true;
 }
@@ -1521,14 +1696,14 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache *pcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (stack.empty())
         return false;
@@ -1551,7 +1726,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache))
             return false;
         if (stackCopy.empty())
             return false;
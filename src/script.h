@@ -5,6 +5,8 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -213,11 +215,120 @@ enum opcodetype
 const char* GetOpName(opcodetype opcode);
 
 
+/** Thrown when a script number is too large to be used as an operand */
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Integer as used by the script interpreter.
+ *
+ * Stack elements are interpreted as little-endian numbers with the sign in
+ * the most significant bit of the last byte. Operands are limited to 4 bytes,
+ * but the results of arithmetic on them may be larger; they can be pushed on
+ * the stack, just not used as operands again. An int64 holds all of these
+ * without any allocation, and behaves exactly like the CBigNum that used to
+ * be used for this.
+ */
+class CScriptNum
+{
+public:
+    static const size_t nMaxNumSize = 4;
+
+    explicit CScriptNum(const int64& n) : m_value(n) {}
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum(const std::vector<unsigned char>&) : overflow");
+        m_value = set_vch(vch);
+    }
+
+    bool operator==(const int64& rhs) const { return m_value == rhs; }
+    bool operator!=(const int64& rhs) const { return m_value != rhs; }
+    bool operator<=(const int64& rhs) const { return m_value <= rhs; }
+    bool operator< (const int64& rhs) const { return m_value <  rhs; }
+    bool operator>=(const int64& rhs) const { return m_value >= rhs; }
+    bool operator> (const int64& rhs) const { return m_value >  rhs; }
+
+    bool operator==(const CScriptNum& rhs) const { return operator==(rhs.m_value); }
+    bool operator!=(const CScriptNum& rhs) const { return operator!=(rhs.m_value); }
+    bool operator<=(const CScriptNum& rhs) const { return operator<=(rhs.m_value); }
+    bool operator< (const CScriptNum& rhs) const { return operator< (rhs.m_value); }
+    bool operator>=(const CScriptNum& rhs) const { return operator>=(rhs.m_value); }
+    bool operator> (const CScriptNum& rhs) const { return operator> (rhs.m_value); }
+
+    CScriptNum operator+(const CScriptNum& rhs) const { return CScriptNum(m_value + rhs.m_value); }
+    CScriptNum operator-(const CScriptNum& rhs) const { return CScriptNum(m_value - rhs.m_value); }
+    CScriptNum operator-() const { return CScriptNum(-m_value); }
+
+    CScriptNum& operator+=(const CScriptNum& rhs) { m_value += rhs.m_value; return *this; }
+    CScriptNum& operator-=(const CScriptNum& rhs) { m_value -= rhs.m_value; return *this; }
+    CScriptNum& operator=(const int64& rhs) { m_value = rhs; return *this; }
+
+    // Like CBigNum::getint(), saturates at the limits of int
+    int getint() const
+    {
+        if (m_value > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        else if (m_value < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return m_value;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        return serialize(m_value);
+    }
+
+    // Minimal encoding of value: no trailing zero bytes, and zero is empty
+    static std::vector<unsigned char> serialize(const int64& value)
+    {
+        unsigned char buf[sizeof(value) + 1];
+        unsigned int nSize = 0;
+        const bool fNegative = value < 0;
+        uint64 nAbs = fNegative ? -(uint64)value : (uint64)value;
+        while (nAbs)
+        {
+            buf[nSize++] = nAbs & 0xff;
+            nAbs >>= 8;
+        }
+        // The sign goes in the high bit of the last byte; add a byte if it is
+        // already taken by the magnitude.
+        if (nSize > 0)
+        {
+            if (buf[nSize - 1] & 0x80)
+                buf[nSize++] = fNegative ? 0x80 : 0;
+            else if (fNegative)
+                buf[nSize - 1] |= 0x80;
+        }
+        return std::vector<unsigned char>(buf, buf + nSize);
+    }
+
+private:
+    static int64 set_vch(const std::vector<unsigned char>& vch)
+    {
+        if (vch.empty())
+            return 0;
+        int64 result = 0;
+        for (unsigned int i = 0; i < vch.size(); i++)
+            result |= (int64)vch[i] << (8 * i);
+        // A set high bit in the last byte means negative; clear it from the magnitude
+        if (vch.back() & 0x80)
+            return -(result & ~((int64)0x80 << (8 * (vch.size() - 1))));
+        return result;
+    }
+
+    int64 m_value;
+};
+
+
 
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
     if (vch.size() <= 4)
-        return strprintf("%d", CBigNum(vch).getint());
+        return strprintf("%d", CScriptNum(vch).getint());
     else
         return HexStr(vch);
 }
@@ -670,10 +781,35 @@ public:
     }
 };
 
+/** Parts of the signature hash computation that are shared between all inputs
+ *  of a transaction. Signature hashes normally require copying and serializing
+ *  the whole transaction for every input, which is quadratic in the number of
+ *  inputs. For SIGHASH_ALL, everything but the input being signed is known in
+ *  advance, so the hash of the preceding inputs is kept as SHA256 midstates,
+ *  and the following inputs and outputs as serialized bytes.
+ *  Immutable after construction, so it can be shared between threads.
+ */
+class CSignatureHashCache
+{
+private:
+    // Hash state after the inputs before nIn, for every nIn
+    std::vector<SHA256_CTX> vMidstate;
+    // Serialization of all inputs, with empty scriptSigs
+    std::vector<char> vchInputs;
+    // Serialization of the outputs and nLockTime
+    std::vector<char> vchOutputs;
+
+public:
+    CSignatureHashCache(const CTransaction &txTo);
+
+    // Compute the same hash as SignatureHash(), for the transaction this was constructed from
+    uint256 SignatureHash(CScript scriptCode, const CTransaction &txTo, unsigned int nIn, int nHashType) const;
+};
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -684,7 +820,15 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache = NULL);
+
+/** Default for -sigcachemb, the memory used by the signature cache in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 4;
+/** Largest accepted -sigcachemb */
+static const unsigned int MAX_SIG_CACHE_SIZE = 1024;
+/** Resize the signature cache to use nBytes of memory, emptying it.
+ *  Must not be called while scripts are being verified. */
+void InitSignatureCache(size_t nBytes);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
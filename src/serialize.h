@@ -1371,4 +1371,41 @@ public:
     }
 };
 
+/** Read-only stream over memory it does not own, such as a mapped file.
+ *  Objects are deserialized straight from that memory without copying it
+ *  into a buffer first.
+ */
+class CBufferReader
+{
+private:
+    const char *pbegin;
+    const char *pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char *pbeginIn, const char *pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
+    size_t size() const { return pend - pbegin; }
+    bool empty() const { return pbegin == pend; }
+
+    CBufferReader& read(char *pch, size_t nSize) {
+        if (nSize > size())
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,179 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "sha256.h"
+
+#include <openssl/sha.h>
+
+#if defined(ENABLE_SSE41) || defined(ENABLE_AVX2)
+#include <cpuid.h>
+#endif
+
+namespace sha256
+{
+
+const uint32_t Init[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+const uint32_t K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// The padding block of a 64-byte message is always the same (0x80, zeroes,
+// and a length of 512 bits), so its message schedule is a constant too.
+const uint32_t PaddingKW[64] =
+{
+    0xc28a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf374,
+    0x649b69c1, 0xf0fe4786, 0x0fe1edc6, 0x240cf254, 0x4fe9346f, 0x6cc984be, 0x61b9411e, 0x16f988fa,
+    0xf2c65152, 0xa88e5a6d, 0xb019fc65, 0xb9d99ec7, 0x9a1231c3, 0xe70eeaa0, 0xfdb1232b, 0xc7353eb0,
+    0x3069bad5, 0xcb976d5f, 0x5a0f118f, 0xdc1eeefd, 0x0a35b689, 0xde0b7a04, 0x58f4ca9d, 0xe15d5b16,
+    0x007f3e86, 0x37088980, 0xa507ea32, 0x6fab9537, 0x17406110, 0x0d8cd6f1, 0xcdaa3b6d, 0xc0bbbe37,
+    0x83613bda, 0xdb48a363, 0x0b02e931, 0x6fd15ca7, 0x521afaca, 0x31338431, 0x6ed41a95, 0x6d437890,
+    0xc39c91f2, 0x9eccabbd, 0xb5c9a0e6, 0x532fb63c, 0xd2c741c6, 0x07237ea3, 0xa4954b68, 0x4c191d76,
+};
+
+static inline uint32_t Ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static inline uint32_t Ch(uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); }
+static inline uint32_t Maj(uint32_t x, uint32_t y, uint32_t z) { return (x & y) | (z & (x | y)); }
+static inline uint32_t Sigma0(uint32_t x) { return Ror(x, 2) ^ Ror(x, 13) ^ Ror(x, 22); }
+static inline uint32_t Sigma1(uint32_t x) { return Ror(x, 6) ^ Ror(x, 11) ^ Ror(x, 25); }
+static inline uint32_t sigma0(uint32_t x) { return Ror(x, 7) ^ Ror(x, 18) ^ (x >> 3); }
+static inline uint32_t sigma1(uint32_t x) { return Ror(x, 17) ^ Ror(x, 19) ^ (x >> 10); }
+
+// One round; the caller rotates the roles of the working variables
+static inline void Round(uint32_t a, uint32_t b, uint32_t c, uint32_t& d, uint32_t e, uint32_t f, uint32_t g, uint32_t& h, uint32_t kw)
+{
+    uint32_t t1 = h + Sigma1(e) + Ch(e, f, g) + kw;
+    uint32_t t2 = Sigma0(a) + Maj(a, b, c);
+    d += t1;
+    h = t1 + t2;
+}
+
+// Run the 64 rounds on state s, with kw[i] the sum of the round constant
+// and the message schedule word i
+static void Rounds(uint32_t* s, const uint32_t* kw)
+{
+    uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8) {
+        Round(a, b, c, d, e, f, g, h, kw[i]);
+        Round(h, a, b, c, d, e, f, g, kw[i+1]);
+        Round(g, h, a, b, c, d, e, f, kw[i+2]);
+        Round(f, g, h, a, b, c, d, e, kw[i+3]);
+        Round(e, f, g, h, a, b, c, d, kw[i+4]);
+        Round(d, e, f, g, h, a, b, c, kw[i+5]);
+        Round(c, d, e, f, g, h, a, b, kw[i+6]);
+        Round(b, c, d, e, f, g, h, a, kw[i+7]);
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+void Transform(uint32_t* s, const uint32_t* w)
+{
+    uint32_t kw[64];
+    uint32_t x[64];
+    for (int i = 0; i < 16; i++)
+        x[i] = w[i];
+    for (int i = 16; i < 64; i++)
+        x[i] = sigma1(x[i-2]) + x[i-7] + sigma0(x[i-15]) + x[i-16];
+    for (int i = 0; i < 64; i++)
+        kw[i] = K[i] + x[i];
+    Rounds(s, kw);
+}
+
+}
+
+// Single inputs are left to OpenSSL, whose assembly picks the fastest
+// single-stream code the CPU has, including the SHA extensions
+static void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    unsigned char hash[32];
+    SHA256(in, 64, hash);
+    SHA256(hash, 32, out);
+}
+
+static const int SHA256D64_SSE41 = 1;
+static const int SHA256D64_AVX2 = 2;
+
+static int DetectSHA256D64()
+{
+    int nFlags = 0;
+#if defined(ENABLE_SSE41) || defined(ENABLE_AVX2)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    unsigned int ecx1 = ecx, ebx7 = 0;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        ebx7 = ebx;
+    }
+#if defined(ENABLE_SSE41)
+    // Four lanes do not beat the SHA extensions used by OpenSSL
+    if ((ecx1 & bit_SSE4_1) && !(ebx7 & (1 << 29)))
+        nFlags |= SHA256D64_SSE41;
+#endif
+#if defined(ENABLE_AVX2)
+    // AVX2 also needs the OS to save the YMM registers
+    if ((ecx1 & bit_OSXSAVE) && (ecx1 & bit_AVX) && (ebx7 & bit_AVX2)) {
+        uint32_t a, d;
+        __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        if ((a & 6) == 6)
+            nFlags |= SHA256D64_AVX2;
+    }
+#endif
+#endif
+    return nFlags;
+}
+
+static int GetSHA256D64()
+{
+    static const int nFlags = DetectSHA256D64();
+    return nFlags;
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+#if defined(ENABLE_SSE41) || defined(ENABLE_AVX2)
+    int nFlags = GetSHA256D64();
+#endif
+#if defined(ENABLE_AVX2)
+    if (nFlags & SHA256D64_AVX2) {
+        for (; nBlocks >= 8; nBlocks -= 8, out += 256, in += 512)
+            sha256::TransformD64_8way_avx2(out, in);
+    }
+#endif
+#if defined(ENABLE_SSE41)
+    if (nFlags & SHA256D64_SSE41) {
+        for (; nBlocks >= 4; nBlocks -= 4, out += 128, in += 256)
+            sha256::TransformD64_4way_sse41(out, in);
+    }
+#endif
+    for (; nBlocks > 0; nBlocks--, out += 32, in += 64)
+        TransformD64(out, in);
+}
+
+std::string SHA256D64Implementation()
+{
+    std::string str;
+    int nFlags = GetSHA256D64();
+    if (nFlags & SHA256D64_AVX2)
+        str += "avx2(8way),";
+    if (nFlags & SHA256D64_SSE41)
+        str += "sse41(4way),";
+    return str + "openssl";
+}
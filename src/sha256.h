@@ -0,0 +1,50 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+/** Double SHA-256 of 64-byte inputs, which is what every inner node of a
+ *  merkle tree needs. Several inputs are hashed at once using the widest
+ *  SIMD kernel the CPU supports (8 lanes with AVX2, 4 with SSE4.1), and
+ *  OpenSSL handles what is left.
+ *
+ *  Single messages (transactions, headers) are still hashed with OpenSSL,
+ *  whose assembly already picks the best single-stream code for the CPU,
+ *  including the SHA extensions where present.
+ */
+
+/** Write the double SHA-256 of nBlocks consecutive 64-byte inputs in
+ *  to the nBlocks consecutive 32-byte outputs at out. out may be equal to
+ *  in, so a merkle tree level can be reduced in place. */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks);
+
+/** Describe the kernels SHA256D64 selected for this CPU */
+std::string SHA256D64Implementation();
+
+namespace sha256
+{
+
+// Initial state, round constants, and the round constants plus the
+// message schedule of the padding block that follows a 64-byte message
+extern const uint32_t Init[8];
+extern const uint32_t K[64];
+extern const uint32_t PaddingKW[64];
+
+/** Perform one SHA-256 transformation of state s, with message words w
+ *  (already converted from big endian). Portable code, for the miner. */
+void Transform(uint32_t* s, const uint32_t* w);
+
+// Multi-lane SHA256D64 kernels for 4 and 8 inputs. Only call these if the
+// CPU supports them; SHA256D64 takes care of that.
+void TransformD64_4way_sse41(unsigned char* out, const unsigned char* in);
+void TransformD64_8way_avx2(unsigned char* out, const unsigned char* in);
+
+}
+
+#endif // BITCOIN_SHA256_H
@@ -0,0 +1,155 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "sha256.h"
+
+#if defined(ENABLE_AVX2)
+
+#include <string.h>
+
+#include <immintrin.h>
+
+// Eight independent SHA-256 computations, one per 32-bit lane. Everything is
+// compiled for AVX2 through the target attribute, and only ever called
+// after SHA256D64 checked that the CPU supports it.
+#define AVX2 __attribute__((target("avx2")))
+
+typedef __m256i V;
+
+namespace
+{
+
+AVX2 inline V Set(uint32_t x) { return _mm256_set1_epi32(x); }
+AVX2 inline V Add(V x, V y) { return _mm256_add_epi32(x, y); }
+AVX2 inline V Xor(V x, V y) { return _mm256_xor_si256(x, y); }
+AVX2 inline V Or(V x, V y) { return _mm256_or_si256(x, y); }
+AVX2 inline V And(V x, V y) { return _mm256_and_si256(x, y); }
+AVX2 inline V Ror(V x, int n) { return Or(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+AVX2 inline V Ch(V x, V y, V z) { return Xor(z, And(x, Xor(y, z))); }
+AVX2 inline V Maj(V x, V y, V z) { return Or(And(x, y), And(z, Or(x, y))); }
+AVX2 inline V Sigma0(V x) { return Xor(Xor(Ror(x, 2), Ror(x, 13)), Ror(x, 22)); }
+AVX2 inline V Sigma1(V x) { return Xor(Xor(Ror(x, 6), Ror(x, 11)), Ror(x, 25)); }
+AVX2 inline V sigma0(V x) { return Xor(Xor(Ror(x, 7), Ror(x, 18)), _mm256_srli_epi32(x, 3)); }
+AVX2 inline V sigma1(V x) { return Xor(Xor(Ror(x, 17), Ror(x, 19)), _mm256_srli_epi32(x, 10)); }
+
+// One round; the caller rotates the roles of the working variables
+AVX2 inline void Round(V a, V b, V c, V& d, V e, V f, V g, V& h, V kw)
+{
+    V t1 = Add(Add(Add(h, Sigma1(e)), Ch(e, f, g)), kw);
+    V t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+// Run the 64 rounds on state s, with kw[i] the sum of the round constant
+// and the message schedule word i
+AVX2 inline void Rounds8(V* s, const V* kw)
+{
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8) {
+        Round(a, b, c, d, e, f, g, h, kw[i]);
+        Round(h, a, b, c, d, e, f, g, kw[i+1]);
+        Round(g, h, a, b, c, d, e, f, kw[i+2]);
+        Round(f, g, h, a, b, c, d, e, kw[i+3]);
+        Round(e, f, g, h, a, b, c, d, kw[i+4]);
+        Round(d, e, f, g, h, a, b, c, kw[i+5]);
+        Round(c, d, e, f, g, h, a, b, kw[i+6]);
+        Round(b, c, d, e, f, g, h, a, kw[i+7]);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+AVX2 inline void Transform8(V* s, const V* w)
+{
+    V x[64];
+    for (int i = 0; i < 16; i++)
+        x[i] = w[i];
+    for (int i = 16; i < 64; i++)
+        x[i] = Add(Add(Add(sigma1(x[i-2]), x[i-7]), sigma0(x[i-15])), x[i-16]);
+    for (int i = 0; i < 64; i++)
+        x[i] = Add(x[i], Set(sha256::K[i]));
+    Rounds8(s, x);
+}
+
+AVX2 inline void InitState(V* s)
+{
+    for (int i = 0; i < 8; i++)
+        s[i] = Set(sha256::Init[i]);
+}
+
+inline int ReadInt(const unsigned char* p)
+{
+    int x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+inline void WriteInt(unsigned char* p, int x)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+// Load word i (big endian) of each of the eight 64-byte inputs
+AVX2 inline V Read8(const unsigned char* in, int i)
+{
+    const V bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    V ret = _mm256_set_epi32(ReadInt(in + 448 + 4 * i), ReadInt(in + 384 + 4 * i),
+                             ReadInt(in + 320 + 4 * i), ReadInt(in + 256 + 4 * i),
+                             ReadInt(in + 192 + 4 * i), ReadInt(in + 128 + 4 * i),
+                             ReadInt(in + 64 + 4 * i), ReadInt(in + 4 * i));
+    return _mm256_shuffle_epi8(ret, bswap);
+}
+
+// Store word i (big endian) of each of the eight 32-byte outputs
+AVX2 inline void Write8(unsigned char* out, int i, V v)
+{
+    const V bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    int words[8];
+    _mm256_storeu_si256((V*)words, _mm256_shuffle_epi8(v, bswap));
+    for (int j = 0; j < 8; j++)
+        WriteInt(out + 32 * j + 4 * i, words[j]);
+}
+
+}
+
+namespace sha256
+{
+
+AVX2 void TransformD64_8way_avx2(unsigned char* out, const unsigned char* in)
+{
+    V w[16], s[8], padding[64];
+
+    // First hash: the message block, then the constant padding block
+    for (int i = 0; i < 16; i++)
+        w[i] = Read8(in, i);
+    InitState(s);
+    Transform8(s, w);
+    for (int i = 0; i < 64; i++)
+        padding[i] = Set(PaddingKW[i]);
+    Rounds8(s, padding);
+
+    // Second hash: a single block with the 32-byte digest and its padding
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = Set(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(256);
+    InitState(s);
+    Transform8(s, w);
+
+    for (int i = 0; i < 8; i++)
+        Write8(out, i, s[i]);
+}
+
+}
+
+#endif
@@ -0,0 +1,152 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "sha256.h"
+
+#if defined(ENABLE_SSE41)
+
+#include <string.h>
+
+#include <immintrin.h>
+
+// Four independent SHA-256 computations, one per 32-bit lane. Everything is
+// compiled for SSE4.1 through the target attribute, and only ever called
+// after SHA256D64 checked that the CPU supports it.
+#define SSE41 __attribute__((target("sse4.1")))
+
+typedef __m128i V;
+
+namespace
+{
+
+SSE41 inline V Set(uint32_t x) { return _mm_set1_epi32(x); }
+SSE41 inline V Add(V x, V y) { return _mm_add_epi32(x, y); }
+SSE41 inline V Xor(V x, V y) { return _mm_xor_si128(x, y); }
+SSE41 inline V Or(V x, V y) { return _mm_or_si128(x, y); }
+SSE41 inline V And(V x, V y) { return _mm_and_si128(x, y); }
+SSE41 inline V Ror(V x, int n) { return Or(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+SSE41 inline V Ch(V x, V y, V z) { return Xor(z, And(x, Xor(y, z))); }
+SSE41 inline V Maj(V x, V y, V z) { return Or(And(x, y), And(z, Or(x, y))); }
+SSE41 inline V Sigma0(V x) { return Xor(Xor(Ror(x, 2), Ror(x, 13)), Ror(x, 22)); }
+SSE41 inline V Sigma1(V x) { return Xor(Xor(Ror(x, 6), Ror(x, 11)), Ror(x, 25)); }
+SSE41 inline V sigma0(V x) { return Xor(Xor(Ror(x, 7), Ror(x, 18)), _mm_srli_epi32(x, 3)); }
+SSE41 inline V sigma1(V x) { return Xor(Xor(Ror(x, 17), Ror(x, 19)), _mm_srli_epi32(x, 10)); }
+
+// One round; the caller rotates the roles of the working variables
+SSE41 inline void Round(V a, V b, V c, V& d, V e, V f, V g, V& h, V kw)
+{
+    V t1 = Add(Add(Add(h, Sigma1(e)), Ch(e, f, g)), kw);
+    V t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+// Run the 64 rounds on state s, with kw[i] the sum of the round constant
+// and the message schedule word i
+SSE41 inline void Rounds4(V* s, const V* kw)
+{
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i += 8) {
+        Round(a, b, c, d, e, f, g, h, kw[i]);
+        Round(h, a, b, c, d, e, f, g, kw[i+1]);
+        Round(g, h, a, b, c, d, e, f, kw[i+2]);
+        Round(f, g, h, a, b, c, d, e, kw[i+3]);
+        Round(e, f, g, h, a, b, c, d, kw[i+4]);
+        Round(d, e, f, g, h, a, b, c, kw[i+5]);
+        Round(c, d, e, f, g, h, a, b, kw[i+6]);
+        Round(b, c, d, e, f, g, h, a, kw[i+7]);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+SSE41 inline void Transform4(V* s, const V* w)
+{
+    V x[64];
+    for (int i = 0; i < 16; i++)
+        x[i] = w[i];
+    for (int i = 16; i < 64; i++)
+        x[i] = Add(Add(Add(sigma1(x[i-2]), x[i-7]), sigma0(x[i-15])), x[i-16]);
+    for (int i = 0; i < 64; i++)
+        x[i] = Add(x[i], Set(sha256::K[i]));
+    Rounds4(s, x);
+}
+
+SSE41 inline void InitState(V* s)
+{
+    for (int i = 0; i < 8; i++)
+        s[i] = Set(sha256::Init[i]);
+}
+
+inline int ReadInt(const unsigned char* p)
+{
+    int x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+inline void WriteInt(unsigned char* p, int x)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+// Load word i (big endian) of each of the four 64-byte inputs
+SSE41 inline V Read4(const unsigned char* in, int i)
+{
+    const V bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    V ret = _mm_set_epi32(ReadInt(in + 192 + 4 * i), ReadInt(in + 128 + 4 * i),
+                          ReadInt(in + 64 + 4 * i), ReadInt(in + 4 * i));
+    return _mm_shuffle_epi8(ret, bswap);
+}
+
+// Store word i (big endian) of each of the four 32-byte outputs
+SSE41 inline void Write4(unsigned char* out, int i, V v)
+{
+    const V bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    v = _mm_shuffle_epi8(v, bswap);
+    WriteInt(out + 4 * i, _mm_extract_epi32(v, 0));
+    WriteInt(out + 32 + 4 * i, _mm_extract_epi32(v, 1));
+    WriteInt(out + 64 + 4 * i, _mm_extract_epi32(v, 2));
+    WriteInt(out + 96 + 4 * i, _mm_extract_epi32(v, 3));
+}
+
+}
+
+namespace sha256
+{
+
+SSE41 void TransformD64_4way_sse41(unsigned char* out, const unsigned char* in)
+{
+    V w[16], s[8], padding[64];
+
+    // First hash: the message block, then the constant padding block
+    for (int i = 0; i < 16; i++)
+        w[i] = Read4(in, i);
+    InitState(s);
+    Transform4(s, w);
+    for (int i = 0; i < 64; i++)
+        padding[i] = Set(PaddingKW[i]);
+    Rounds4(s, padding);
+
+    // Second hash: a single block with the 32-byte digest and its padding
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = Set(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(256);
+    InitState(s);
+    Transform4(s, w);
+
+    for (int i = 0; i < 8; i++)
+        Write4(out, i, s[i]);
+}
+
+}
+
+#endif
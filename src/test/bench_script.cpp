@@ -0,0 +1,190 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Evaluate the scripts of test/data/script_valid.json repeatedly, and report
+// the heap allocations and time per evaluation, to compare changes to the
+// script interpreter. Build it at two revisions and compare their output:
+//
+//   bench_script [iterations] [-v]
+//
+// -v also lists the allocations per evaluation of each script. This is not
+// part of the test suite: it counts allocations by replacing the global
+// operator new, which only a single-threaded binary of its own can do.
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "main.h"
+#include "script.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "wallet.h"
+#include "data/script_valid.json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace json_spirit;
+using namespace boost::algorithm;
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static bool fCounting = false;
+static uint64 nAllocations = 0;
+
+void* operator new(size_t nSize)
+{
+    if (fCounting)
+        nAllocations++;
+    void *p = malloc(nSize ? nSize : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t nSize)
+{
+    return operator new(nSize);
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    free(p);
+}
+
+// The notation of script_tests.cpp, without its error reporting
+static bool ParseScript(const string &s, CScript &result)
+{
+    static map<string, opcodetype> mapOpNames;
+    if (mapOpNames.empty()) {
+        for (int op = 0; op <= OP_NOP10; op++) {
+            if (op < OP_NOP && op != OP_RESERVED)
+                continue;
+            const char* name = GetOpName((opcodetype)op);
+            if (strcmp(name, "OP_UNKNOWN") == 0)
+                continue;
+            string strName(name);
+            mapOpNames[strName] = (opcodetype)op;
+            replace_first(strName, "OP_", "");
+            mapOpNames[strName] = (opcodetype)op;
+        }
+    }
+
+    result = CScript();
+    vector<string> words;
+    split(words, s, is_any_of(" \t\n"), token_compress_on);
+    BOOST_FOREACH(const string &w, words) {
+        if (w.empty())
+            continue;
+        if (all(w, is_digit()) || (starts_with(w, "-") && all(string(w.begin()+1, w.end()), is_digit()))) {
+            result << atoi64(w);
+        } else if (starts_with(w, "0x") && IsHex(string(w.begin()+2, w.end()))) {
+            std::vector<unsigned char> raw = ParseHex(string(w.begin()+2, w.end()));
+            result.insert(result.end(), raw.begin(), raw.end());
+        } else if (w.size() >= 2 && starts_with(w, "'") && ends_with(w, "'")) {
+            result << std::vector<unsigned char>(w.begin()+1, w.end()-1);
+        } else if (mapOpNames.count(w)) {
+            result << mapOpNames[w];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int nIterations = 1000;
+    bool fVerbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0)
+            fVerbose = true;
+        else
+            nIterations = std::max(atoi(argv[i]), 1);
+    }
+
+    fPrintToDebugger = true;
+    noui_connect();
+    InitSignatureCache(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    static const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+
+    Value v;
+    string strJson(json_tests::script_valid, json_tests::script_valid + sizeof(json_tests::script_valid));
+    if (!read_string(strJson, v) || v.type() != array_type) {
+        fprintf(stderr, "Parse error in script_valid.json\n");
+        return 1;
+    }
+    vector<pair<CScript, CScript> > vScripts;
+    vector<string> vNames;
+    BOOST_FOREACH(const Value &tv, v.get_array()) {
+        const Array &test = tv.get_array();
+        if (test.size() < 2)
+            continue;
+        CScript scriptSig, scriptPubKey;
+        if (!ParseScript(test[0].get_str(), scriptSig) || !ParseScript(test[1].get_str(), scriptPubKey)) {
+            fprintf(stderr, "Parse error: %s\n", write_string(tv, false).c_str());
+            return 1;
+        }
+        vScripts.push_back(make_pair(scriptSig, scriptPubKey));
+        vNames.push_back(write_string(tv, false));
+    }
+
+    CTransaction tx;
+    uint64 nTotalAllocations = 0;
+    int64 nTotalTime = 0;
+    unsigned int nFailed = 0;
+    for (unsigned int i = 0; i < vScripts.size(); i++) {
+        // The first evaluation may fill static caches, so it is not counted
+        if (!VerifyScript(vScripts[i].first, vScripts[i].second, tx, 0, flags, SIGHASH_NONE))
+            nFailed++;
+        nAllocations = 0;
+        int64 nStart = GetTimeMicros();
+        fCounting = true;
+        for (int n = 0; n < nIterations; n++)
+            VerifyScript(vScripts[i].first, vScripts[i].second, tx, 0, flags, SIGHASH_NONE);
+        fCounting = false;
+        nTotalTime += GetTimeMicros() - nStart;
+        nTotalAllocations += nAllocations;
+        if (fVerbose)
+            printf("%8.2f %s\n", (double)nAllocations / nIterations, vNames[i].c_str());
+    }
+
+    uint64 nEvaluations = (uint64)vScripts.size() * nIterations;
+    printf("%u scripts, %d iterations: %.2f allocations and %.3f us per evaluation\n",
+           (unsigned int)vScripts.size(), nIterations,
+           (double)nTotalAllocations / nEvaluations, (double)nTotalTime / nEvaluations);
+    if (nFailed)
+        printf("%u scripts failed to verify\n", nFailed);
+    return nFailed ? 1 : 0;
+}
@@ -8,6 +8,7 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
 
+#include "chainparams.h"
 #include "main.h"
 #include "wallet.h"
 #include "net.h"
@@ -61,4 +62,103 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(CheckBlock_mutated)
+{
+    // CheckBlock keeps no result in the block: changing the transactions of
+    // a block that passed, even without changing its header, makes it fail.
+    CBlock block = Params().GenesisBlock();
+    CValidationState state;
+    BOOST_CHECK(CheckBlock(block, state));
+    block.vtx.push_back(block.vtx[0]);
+    block.vtx[1].vin[0].scriptSig << OP_0;
+    BOOST_CHECK(block.GetHash() == Params().HashGenesisBlock());
+    BOOST_CHECK(!CheckBlock(block, state));
+}
+
+BOOST_AUTO_TEST_CASE(CheckBlock_reused)
+{
+    // A block checked by the closure into a reused destination only gets the
+    // result for its own contents.
+    CBlock good = Params().GenesisBlock();
+    CBlock bad = good;
+    bad.vtx.push_back(bad.vtx[0]);
+    bad.vtx[1].vin[0].scriptSig << OP_0;
+    BOOST_CHECK(bad.GetHash() == good.GetHash());
+
+    CDataStream ssGood(SER_DISK, CLIENT_VERSION), ssBad(SER_DISK, CLIENT_VERSION);
+    ssGood << good;
+    ssBad << bad;
+    std::vector<char> vGood(ssGood.begin(), ssGood.end());
+    std::vector<char> vBad(ssBad.begin(), ssBad.end());
+    CBlock block;
+    unsigned int nSize = 0;
+    bool fChecked = false;
+    CBlockCheck checkGood(vGood, block, nSize, fChecked);
+    BOOST_CHECK(checkGood());
+    BOOST_CHECK(fChecked);
+    CBlockCheck checkBad(vBad, block, nSize, fChecked);
+    BOOST_CHECK(checkBad());
+    BOOST_CHECK(block.vtx.size() == 2);
+    BOOST_CHECK(!fChecked);
+}
+
+BOOST_AUTO_TEST_CASE(CheckBlock_closure)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << Params().GenesisBlock();
+    std::vector<char> vData(ss.begin(), ss.end());
+    unsigned int nSerSize = vData.size();
+    // Trailing garbage is not part of the block
+    vData.push_back(0x42);
+
+    CBlock block;
+    unsigned int nSize = 0;
+    bool fChecked = false;
+    CBlockCheck check(vData, block, nSize, fChecked);
+    BOOST_CHECK(vData.empty());
+    BOOST_CHECK(check());
+    BOOST_CHECK_EQUAL(nSize, nSerSize);
+    BOOST_CHECK(block.GetHash() == Params().HashGenesisBlock());
+    BOOST_CHECK(fChecked);
+
+    // Truncated data is not a block
+    std::vector<char> vTruncated(ss.begin(), ss.begin() + 100);
+    CBlockCheck checkTruncated(vTruncated, block, nSize, fChecked);
+    BOOST_CHECK(checkTruncated());
+    BOOST_CHECK_EQUAL(nSize, 0U);
+    BOOST_CHECK(block.IsNull());
+    BOOST_CHECK(!fChecked);
+}
+
+BOOST_AUTO_TEST_CASE(ReadBlockFromDisk_mapped)
+{
+    // The test fixture wrote the genesis block to blk00000.dat; the second
+    // read is served from the cached mapping
+    CBlockIndex* pindex = FindBlockByHeight(0);
+    BOOST_REQUIRE(pindex != NULL);
+    for (int i = 0; i < 2; i++) {
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, pindex));
+        BOOST_CHECK(block.GetHash() == Params().HashGenesisBlock());
+    }
+
+    // Positions past the end of the data fail cleanly
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    pos.nPos += MAX_BLOCKFILE_SIZE;
+    CBlock block;
+    BOOST_CHECK(!ReadBlockFromDisk(block, pos));
+}
+
+BOOST_AUTO_TEST_CASE(ReadBlockFromDisk_cached)
+{
+    CBlockIndex* pindex = FindBlockByHeight(0);
+    BOOST_REQUIRE(pindex != NULL);
+    boost::shared_ptr<const CBlock> pblock = ReadBlockFromDiskCached(pindex);
+    BOOST_REQUIRE(pblock);
+    BOOST_CHECK(pblock->GetHash() == Params().HashGenesisBlock());
+
+    // The second read is the same object, not a new copy
+    BOOST_CHECK(ReadBlockFromDiskCached(pindex) == pblock);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
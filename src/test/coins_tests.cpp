@@ -0,0 +1,883 @@
+#include <map>
+#include <set>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+#include "hash.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+namespace
+{
+class CCoinsViewTest : public CCoinsView
+{
+    CBlockIndex *pindexBest;
+    std::map<uint256, CCoins> map_;
+
+public:
+    CCoinsViewTest() : pindexBest(NULL), nWrites(0) { }
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::iterator it = map_.find(txid);
+        if (it == map_.end())
+            return false;
+        coins = it->second;
+        if (coins.IsPruned() && GetRand(2) == 0) {
+            // Randomly return false in case of an empty entry.
+            return false;
+        }
+        return true;
+    }
+
+    bool SetCoins(const uint256 &txid, const CCoins &coins)
+    {
+        map_[txid] = coins;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        CCoins coins;
+        return GetCoins(txid, coins);
+    }
+
+    CBlockIndex *GetBestBlock() { return pindexBest; }
+
+    bool SetBestBlock(CBlockIndex *pindex)
+    {
+        pindexBest = pindex;
+        return true;
+    }
+
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                map_[it->first] = it->second.coins;
+                nWrites++;
+            }
+        }
+        mapCoins.clear();
+        pindexBest = pindex;
+        return true;
+    }
+
+    // Number of entries written by BatchWrite
+    unsigned int nWrites;
+
+    bool GetStats(CCoinsStats &stats) { return false; }
+};
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView &base) : CCoinsViewCache(base) { }
+
+    // Recompute the memory usage of the cached entries from scratch, and
+    // check that every dirty entry is listed for the next Sync
+    void SelfTest() const
+    {
+        size_t ret = memusage::DynamicUsage(cacheCoins) + memusage::DynamicUsage(vDirtyKeys);
+        std::set<uint256> setDirtyKeys(vDirtyKeys.begin(), vDirtyKeys.end());
+        unsigned int nDirty = 0;
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                nDirty++;
+                BOOST_CHECK(setDirtyKeys.count(it->first));
+            }
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+        BOOST_CHECK_EQUAL(GetDirtyCacheSize(), nDirty);
+    }
+
+    // Flags of the cached entry of txid, or -1 if it isn't cached
+    int GetFlags(const uint256 &txid) const
+    {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        return it == cacheCoins.end() ? -1 : it->second.flags;
+    }
+};
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
+
+// This is a large randomized insert/remove simulation test on a variable-size
+// stack of caches on top of CCoinsViewTest.
+//
+// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// new tip is added to the stack of caches, or the tip is flushed and removed.
+//
+// During the process, booleans are kept to make sure that the randomized
+// operation hits all branches.
+BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
+{
+    // Various coverage trackers.
+    bool removed_all_caches = false;
+    bool reached_4_caches = false;
+    bool added_a_entry = false;
+    bool removed_a_entry = false;
+    bool updated_a_entry = false;
+    bool found_an_entry = false;
+    bool missed_an_entry = false;
+    bool synced_and_trimmed = false;
+
+    // A simple map to track what we expect the cache stack to represent.
+    std::map<uint256, CCoins> result;
+
+    // The cache stack.
+    CCoinsViewTest base; // A CCoinsViewTest at the bottom.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(base)); // Start with one cache.
+
+    // Use a limited set of random transaction ids, so we do test overwriting entries.
+    std::vector<uint256> txids;
+    txids.resize(NUM_SIMULATION_ITERATIONS / 8);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i] = GetRandHash();
+    }
+
+    for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
+        // Do a random modification.
+        {
+            uint256 txid = txids[GetRand(txids.size())]; // txid we're going to modify in this iteration.
+            CCoins& coins = result[txid];
+            CCoins entry;
+            bool fFound = stack.back()->GetCoins(txid, entry);
+            BOOST_CHECK(coins == entry || (coins.IsPruned() && (!fFound || entry.IsPruned())));
+
+            if (GetRand(5) == 0 || coins.IsPruned()) {
+                if (coins.IsPruned()) {
+                    added_a_entry = true;
+                } else {
+                    updated_a_entry = true;
+                }
+                coins.nVersion = GetRand(0xFFFFFFFF);
+                coins.vout.resize(1);
+                coins.vout[0].nValue = GetRand(0xFFFFFFFF);
+                coins.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(GetRand(64), 0x51);
+                stack.back()->SetCoins(txid, coins);
+            } else {
+                removed_a_entry = true;
+                coins = CCoins();
+                stack.back()->SetCoins(txid, coins);
+            }
+        }
+
+        // Once every 1000 iterations and at the end, verify the full cache.
+        if (GetRand(1000) == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
+            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
+                CCoins coins;
+                stack.back()->GetCoins(it->first, coins);
+                if (coins.IsPruned()) {
+                    BOOST_CHECK(it->second.IsPruned());
+                    missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoins(it->first));
+                    BOOST_CHECK(coins == it->second);
+                    found_an_entry = true;
+                }
+            }
+            for (unsigned int c = 0; c < stack.size(); c++)
+                stack[c]->SelfTest();
+        }
+
+        if (GetRand(50) == 0) {
+            // Every 50 iterations, write out the tip's changes but keep its
+            // contents, and sometimes evict part of them afterwards.
+            BOOST_CHECK(stack.back()->Sync());
+            BOOST_CHECK_EQUAL(stack.back()->GetDirtyCacheSize(), 0U);
+            if (GetRand(2) == 0) {
+                stack.back()->Trim(GetRand(stack.back()->DynamicMemoryUsage() + 1));
+                synced_and_trimmed = true;
+            }
+        }
+
+        if (GetRand(100) == 0) {
+            // Every 100 iterations, change the cache stack.
+            if (stack.size() > 0 && GetRand(2) == 0) {
+                stack.back()->Flush();
+                delete stack.back();
+                stack.pop_back();
+            }
+            if (stack.size() == 0 || (stack.size() < 4 && GetRand(2))) {
+                CCoinsView* tip = &base;
+                if (stack.size() > 0) {
+                    tip = stack.back();
+                } else {
+                    removed_all_caches = true;
+                }
+                stack.push_back(new CCoinsViewCacheTest(*tip));
+                if (stack.size() == 4) {
+                    reached_4_caches = true;
+                }
+            }
+        }
+    }
+
+    // Clean up the stack.
+    while (stack.size() > 0) {
+        delete stack.back();
+        stack.pop_back();
+    }
+
+    // Verify coverage.
+    BOOST_CHECK(removed_all_caches);
+    BOOST_CHECK(reached_4_caches);
+    BOOST_CHECK(added_a_entry);
+    BOOST_CHECK(removed_a_entry);
+    BOOST_CHECK(updated_a_entry);
+    BOOST_CHECK(found_an_entry);
+    BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(synced_and_trimmed);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_dirty_fresh)
+{
+    CCoinsViewTest base;
+    uint256 txidOld = GetRandHash();
+    uint256 txidNew = GetRandHash();
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.vout.resize(2);
+    coins.vout[0].nValue = 1;
+    coins.vout[1].nValue = 2;
+    base.SetCoins(txidOld, coins);
+
+    {
+        CCoinsViewCacheTest cache(base);
+        // Entries that are only read are not written back.
+        BOOST_CHECK(cache.HaveCoins(txidOld));
+        BOOST_CHECK(cache.GetCoins(txidOld) == coins);
+        // Entries created and entirely spent within the cache never reach the parent.
+        cache.SetCoins(txidNew, coins);
+        {
+            CCoinsModifier mod = cache.ModifyCoins(txidNew);
+            BOOST_CHECK(mod->Spend(0));
+            BOOST_CHECK(mod->Spend(1));
+        }
+        cache.SelfTest();
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 0U);
+    }
+
+    {
+        CCoinsViewCacheTest cache(base);
+        // Spending an output of an entry the parent has is written back.
+        {
+            CCoinsModifier mod = cache.ModifyCoins(txidOld);
+            BOOST_CHECK(mod->Spend(1));
+        }
+        cache.SelfTest();
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 1U);
+        CCoins result;
+        BOOST_CHECK(base.GetCoins(txidOld, result));
+        BOOST_CHECK(result.IsAvailable(0));
+        BOOST_CHECK(!result.IsAvailable(1));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_sync_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(base);
+    std::vector<CBlockIndex> vIndex(3);
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 3; i++) {
+        vIndex[i].nHeight = i;
+        cache.SetBestBlock(&vIndex[i]);
+        // Create one transaction per "block".
+        CCoins coins;
+        coins.nVersion = 1;
+        coins.vout.resize(1);
+        coins.vout[0].nValue = i + 1;
+        coins.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        vTxid.push_back(GetRandHash());
+        cache.SetCoins(vTxid.back(), coins);
+    }
+    BOOST_CHECK_EQUAL(cache.GetDirtyCacheSize(), 3U);
+
+    // Sync writes everything, but keeps it cached.
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(base.nWrites, 3U);
+    BOOST_CHECK_EQUAL(cache.GetDirtyCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 3U);
+    cache.SelfTest();
+
+    // A second sync has nothing to write.
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(base.nWrites, 3U);
+
+    // Touch the oldest entry again at the current height, then trim just
+    // enough to evict a single entry: it must be the least recently used one.
+    BOOST_CHECK(cache.HaveCoins(vTxid[0]));
+    size_t nUsage = cache.DynamicMemoryUsage();
+    cache.Trim(nUsage - 1);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2U);
+    cache.SelfTest();
+
+    // Dirty entries are never evicted.
+    {
+        CCoinsModifier mod = cache.ModifyCoins(vTxid[2]);
+        mod->vout[0].nValue = 10;
+    }
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetDirtyCacheSize(), 1U);
+    BOOST_CHECK(cache.Flush());
+    CCoins result;
+    BOOST_CHECK(base.GetCoins(vTxid[1], result));
+    BOOST_CHECK(base.GetCoins(vTxid[2], result));
+    BOOST_CHECK_EQUAL(result.vout[0].nValue, 10);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_prefetch)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(base);
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 4; i++) {
+        CCoins coins;
+        coins.nVersion = 1;
+        coins.vout.resize(1);
+        coins.vout[0].nValue = i + 1;
+        vTxid.push_back(GetRandHash());
+        base.SetCoins(vTxid.back(), coins);
+    }
+    // Unknown txids are looked up, but not cached.
+    vTxid.push_back(GetRandHash());
+
+    BOOST_CHECK_EQUAL(cache.Prefetch(vTxid, NULL), 5U);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 4U);
+    BOOST_CHECK_EQUAL(cache.GetDirtyCacheSize(), 0U);
+    cache.SelfTest();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK_EQUAL(cache.GetCoins(vTxid[i]).vout[0].nValue, i + 1);
+
+    // Entries already in the cache are not fetched again.
+    BOOST_CHECK_EQUAL(cache.Prefetch(vTxid, NULL), 1U);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+}
+
+static bool CompareKeyOrder(const uint256 &a, const uint256 &b)
+{
+    return memcmp(a.begin(), b.begin(), sizeof(a)) < 0;
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_stats)
+{
+    // The parallel scan must give exactly the result of one pass over the
+    // coins in database key order
+    CCoinsViewDB db(1 << 20, true);
+    CBlockIndex *pindex = FindBlockByHeight(0);
+    BOOST_REQUIRE(pindex != NULL);
+    BOOST_CHECK(db.SetBestBlock(pindex));
+
+    std::vector<uint256> vTxid;
+    std::map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 2000; i++) {
+        CCoins coins;
+        coins.nVersion = 1;
+        coins.fCoinBase = (i % 10 == 0);
+        coins.nHeight = i;
+        coins.vout.resize(1 + i % 3);
+        for (unsigned int j = 0; j < coins.vout.size(); j++) {
+            coins.vout[j].nValue = i + j;
+            coins.vout[j].scriptPubKey << i;
+        }
+        if (coins.vout.size() > 1)
+            coins.vout[0].SetNull();
+        vTxid.push_back(GetRandHash());
+        mapCoins[vTxid.back()] = coins;
+        BOOST_CHECK(db.SetCoins(vTxid.back(), coins));
+    }
+    std::sort(vTxid.begin(), vTxid.end(), CompareKeyOrder);
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << pindex->GetBlockHash();
+    uint64 nTransactionOutputs = 0;
+    int64 nTotalAmount = 0;
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        const CCoins &coins = mapCoins[txid];
+        ss << txid << VARINT(coins.nVersion) << (coins.fCoinBase ? 'c' : 'n') << VARINT(coins.nHeight);
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull()) {
+                nTransactionOutputs++;
+                nTotalAmount += coins.vout[i].nValue;
+                ss << VARINT(i+1) << coins.vout[i];
+            }
+        }
+        ss << VARINT(0);
+    }
+
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(stats.hashBlock == pindex->GetBlockHash());
+    BOOST_CHECK_EQUAL(stats.nHeight, 0);
+    BOOST_CHECK_EQUAL(stats.nTransactions, vTxid.size());
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nTransactionOutputs);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, nTotalAmount);
+    BOOST_CHECK(stats.hashSerialized == ss.GetHash());
+}
+
+namespace
+{
+// Gives access to the raw database, to write coins in the old format
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    bool WriteOldCoins(const uint256 &txid, const CCoins &coins) { return db.Write(std::make_pair('c', txid), coins); }
+    bool HaveOldCoins(const uint256 &txid) { return db.Exists(std::make_pair('c', txid)); }
+    bool HaveOutput(const uint256 &txid, unsigned int n) { return db.Exists(std::make_pair('o', COutPoint(txid, n))); }
+    bool HaveTxRecord(const uint256 &txid) { return db.Exists(std::make_pair('o', txid)); }
+    bool EraseOutput(const uint256 &txid, unsigned int n) { return db.Erase(std::make_pair('o', COutPoint(txid, n))); }
+    bool WriteVersion(int nVersion) { return db.Write('V', nVersion); }
+    bool ReadVersion(int &nVersion) { return db.Read('V', nVersion); }
+    bool WriteOldBestBlock(const uint256 &hash) { return db.Write('B', hash); }
+    bool HaveOldBestBlock() { return db.Exists('B'); }
+    bool ReadBestBlockHash(uint256 &hash) { return db.Read('H', hash); }
+};
+
+// Database whose batch writes wait until Release is called, to keep the
+// write of a CCoinsViewBackgroundWriter in flight
+class CCoinsViewDBBlocking : public CCoinsViewDB
+{
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fReleased;
+
+public:
+    CCoinsViewDBBlocking() : CCoinsViewDB(1 << 20, true), fReleased(false) {}
+
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fReleased)
+                cond.wait(lock);
+        }
+        return CCoinsViewDB::BatchWrite(mapCoins, pindex);
+    }
+
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReleased = true;
+        cond.notify_all();
+    }
+};
+
+CCoins RandomCoins(int nHeight)
+{
+    CCoins coins;
+    coins.nVersion = 1 + insecure_rand() % 2;
+    coins.fCoinBase = (insecure_rand() % 10 == 0);
+    coins.nHeight = nHeight;
+    coins.vout.resize(1 + insecure_rand() % 20);
+    for (unsigned int j = 0; j < coins.vout.size(); j++) {
+        coins.vout[j].nValue = insecure_rand();
+        coins.vout[j].scriptPubKey << (int)(insecure_rand() % 1000);
+    }
+    for (unsigned int j = 0; j + 1 < coins.vout.size(); j++)
+        if (insecure_rand() % 3 == 0)
+            coins.vout[j].SetNull();
+    return coins;
+}
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 25000; i++) {
+        uint256 txid = GetRandHash();
+        mapCoins[txid] = RandomCoins(i);
+        BOOST_CHECK(db.WriteOldCoins(txid, mapCoins[txid]));
+    }
+    uint256 hashBest = GetRandHash();
+    BOOST_CHECK(db.WriteOldBestBlock(hashBest));
+    BOOST_CHECK(!db.HaveCoins(mapCoins.begin()->first));
+
+    BOOST_CHECK(db.Upgrade());
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(!db.HaveOldCoins(it->first));
+        BOOST_CHECK(db.HaveCoins(it->first));
+        BOOST_CHECK(db.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+    // The best block moved, so earlier versions don't find it
+    uint256 hashRead;
+    BOOST_CHECK(!db.HaveOldBestBlock());
+    BOOST_CHECK(db.ReadBestBlockHash(hashRead));
+    BOOST_CHECK(hashRead == hashBest);
+    // Nothing left to do the second time
+    BOOST_CHECK(db.Upgrade());
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade_interrupted)
+{
+    {
+        // Outputs copied before the conversion was interrupted are dropped,
+        // as an earlier version may have spent them since
+        CCoinsViewDBTest db;
+        uint256 txidSpent = GetRandHash(), txid = GetRandHash();
+        CCoins coins = RandomCoins(1);
+        BOOST_CHECK(db.SetCoins(txidSpent, RandomCoins(1)));
+        BOOST_CHECK(db.WriteOldCoins(txid, coins));
+        BOOST_CHECK(db.WriteOldBestBlock(GetRandHash()));
+        BOOST_CHECK(db.Upgrade());
+        CCoins coinsRead;
+        BOOST_CHECK(!db.HaveCoins(txidSpent));
+        BOOST_CHECK(!db.HaveOutput(txidSpent, 0));
+        BOOST_CHECK(db.GetCoins(txid, coinsRead));
+        BOOST_CHECK(coinsRead == coins);
+    }
+    {
+        // Old records left after the switch are erased on the next start
+        CCoinsViewDBTest db;
+        BOOST_CHECK(db.Upgrade());
+        uint256 txid = GetRandHash();
+        BOOST_CHECK(db.WriteOldCoins(txid, RandomCoins(1)));
+        BOOST_CHECK(db.Upgrade());
+        BOOST_CHECK(!db.HaveOldCoins(txid));
+        BOOST_CHECK(!db.HaveCoins(txid));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_outputs)
+{
+    // Spending outputs through a cache only erases their records
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    {
+        CCoinsViewCache cache(db);
+        for (int i = 0; i < 100; i++) {
+            uint256 txid = GetRandHash();
+            mapCoins[txid] = RandomCoins(i);
+            *cache.ModifyCoins(txid) = mapCoins[txid];
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // First with new caches, which load what they spend, then with one that
+    // keeps its entries across syncs
+    CCoinsViewCache cacheKept(db);
+    for (int n = 0; n < 10; n++) {
+        CCoinsViewCache cacheNew(db);
+        CCoinsViewCache &cache = n < 5 ? cacheNew : cacheKept;
+        for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            CCoins &coins = it->second;
+            if (coins.IsPruned())
+                continue;
+            unsigned int nOut = insecure_rand() % coins.vout.size();
+            coins.vout[nOut].SetNull();
+            coins.Cleanup();
+            CCoinsModifier modifier = cache.ModifyCoins(it->first);
+            modifier->vout[nOut].SetNull();
+            modifier->Cleanup();
+        }
+        BOOST_CHECK(n < 5 ? cache.Flush() : cache.Sync());
+
+        for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            CCoins coins;
+            BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+            BOOST_CHECK_EQUAL(db.HaveCoins(it->first), !it->second.IsPruned());
+            BOOST_CHECK(coins.vout == it->second.vout);
+            BOOST_CHECK_EQUAL(db.HaveTxRecord(it->first), !it->second.IsPruned());
+            for (unsigned int i = 0; i < 20; i++)
+                BOOST_CHECK_EQUAL(db.HaveOutput(it->first, i), i < it->second.vout.size() && !it->second.vout[i].IsNull());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_stored)
+{
+    // What a cache entry knows to be stored replaces reading it back, and
+    // the record is read back when it does not know
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coinsOld;
+    coinsOld.nVersion = 1;
+    coinsOld.fCoinBase = true;
+    coinsOld.nHeight = 1;
+    coinsOld.vout.resize(3);
+    for (unsigned int i = 0; i < coinsOld.vout.size(); i++) {
+        coinsOld.vout[i].nValue = i + 1;
+        coinsOld.vout[i].scriptPubKey << (int)i;
+    }
+    BOOST_CHECK(db.SetCoins(txid, coinsOld));
+
+    // A transaction with the same txid replaces it at a later height
+    CCoins coinsNew = coinsOld;
+    coinsNew.nHeight++;
+    coinsNew.vout.resize(2);
+    {
+        CCoinsViewCache cache(db);
+        BOOST_CHECK(cache.HaveCoins(txid));
+        *cache.ModifyCoins(txid) = coinsNew;
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, coinsNew.nHeight);
+    BOOST_CHECK(coins.vout == coinsNew.vout);
+    BOOST_CHECK(!db.HaveOutput(txid, 2));
+
+    // An entry that does not know what is stored
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry &entry = mapCoins[txid];
+    entry.coins = coinsNew;
+    entry.coins.vout[0].SetNull();
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(!entry.IsStoredKnown());
+    BOOST_CHECK(db.BatchWrite(mapCoins, NULL));
+    BOOST_CHECK(!db.HaveOutput(txid, 0));
+    BOOST_CHECK(db.HaveOutput(txid, 1));
+
+    // Nor can it know for transactions with more outputs than it tracks
+    entry.SetStored(coinsNew);
+    BOOST_CHECK(entry.IsStoredKnown());
+    coins.vout.resize(65, coinsNew.vout[1]);
+    entry.SetStored(coins);
+    BOOST_CHECK(!entry.IsStoredKnown());
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_version)
+{
+    int nVersion = 0;
+    {
+        // A new database gets the current version
+        CCoinsViewDBTest db;
+        BOOST_CHECK(!db.ReadVersion(nVersion));
+        BOOST_CHECK(db.Upgrade());
+        BOOST_CHECK(db.ReadVersion(nVersion));
+        BOOST_CHECK(db.Upgrade());
+    }
+    {
+        // One written by a later version is refused
+        CCoinsViewDBTest db;
+        BOOST_CHECK(db.WriteVersion(nVersion + 1));
+        BOOST_CHECK(!db.Upgrade());
+    }
+    {
+        // So is one that an earlier version has written to since it was
+        // converted, which it marks with its best block
+        CCoinsViewDBTest db;
+        BOOST_CHECK(db.Upgrade());
+        BOOST_CHECK(db.WriteOldCoins(GetRandHash(), RandomCoins(1)));
+        BOOST_CHECK(db.WriteOldBestBlock(GetRandHash()));
+        BOOST_CHECK(!db.Upgrade());
+    }
+    {
+        // An upgraded one only gets its version once converted
+        CCoinsViewDBTest db;
+        BOOST_CHECK(db.WriteOldCoins(GetRandHash(), RandomCoins(1)));
+        BOOST_CHECK(db.Upgrade());
+        int nUpgraded = 0;
+        BOOST_CHECK(db.ReadVersion(nUpgraded));
+        BOOST_CHECK_EQUAL(nUpgraded, nVersion);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_missing_output)
+{
+    // Outputs that disappeared from under their transaction record are
+    // reported, not silently dropped
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomCoins(1);
+    BOOST_CHECK(db.SetCoins(txid, coins));
+    BOOST_CHECK(db.EraseOutput(txid, coins.vout.size() - 1));
+    BOOST_CHECK(db.HaveCoins(txid));
+    CCoins coinsRead;
+    BOOST_CHECK_THROW(db.GetCoins(txid, coinsRead), leveldb_error);
+}
+
+BOOST_AUTO_TEST_CASE(coins_background_writer)
+{
+    // Flushed coins can be looked up while they are being written, and end
+    // up in the database once the writer is done
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewBackgroundWriter writer(db);
+    std::map<uint256, CCoins> mapCoins;
+    for (int n = 0; n < 20; n++) {
+        CCoinsViewCache cache(writer);
+        for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (it->second.IsPruned() || insecure_rand() % 4)
+                continue;
+            it->second.vout.clear();
+            cache.ModifyCoins(it->first)->vout.clear();
+        }
+        for (int i = 0; i < 100; i++) {
+            uint256 txid = GetRandHash();
+            mapCoins[txid] = RandomCoins(n);
+            *cache.ModifyCoins(txid) = mapCoins[txid];
+        }
+        size_t nUsage = cache.DynamicMemoryUsage();
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(writer.DynamicMemoryUsage() <= nUsage);
+
+        for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            CCoins coins;
+            if (writer.GetCoins(it->first, coins) && !coins.IsPruned())
+                BOOST_CHECK(coins == it->second);
+            else
+                BOOST_CHECK(it->second.IsPruned());
+        }
+    }
+
+    // The memory of a written batch is released
+    BOOST_CHECK(writer.Wait());
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+        if (!it->second.IsPruned())
+            BOOST_CHECK(coins == it->second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_background_writer_prefetch)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewBackgroundWriter writer(db);
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 10; i++) {
+        vTxid.push_back(GetRandHash());
+        BOOST_CHECK(db.SetCoins(vTxid.back(), RandomCoins(i)));
+    }
+    // Coins that are not in the database are not read
+    std::vector<uint256> vPrefetch(vTxid);
+    vPrefetch.push_back(GetRandHash());
+    BOOST_CHECK_EQUAL(writer.Prefetch(vPrefetch), 10U);
+    BOOST_CHECK(writer.DynamicMemoryUsage() > 0);
+    BOOST_CHECK(writer.HaveCoins(vTxid[0]));
+    BOOST_CHECK(!writer.HaveCoins(vPrefetch.back()));
+
+    // A write drops the prefetched coins it changes
+    CCoins coins;
+    {
+        CCoinsMap mapCoins;
+        CCoinsCacheEntry &entry = mapCoins[vTxid[0]];
+        BOOST_CHECK(db.GetCoins(vTxid[0], entry.coins));
+        entry.coins.nHeight = 100;
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        BOOST_CHECK(writer.BatchWrite(mapCoins, NULL));
+    }
+    BOOST_CHECK(writer.Wait());
+    BOOST_CHECK(writer.GetCoins(vTxid[0], coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 100);
+
+    // The database is not read again for the others, which are still
+    // returned after it changes behind the writer's back
+    CCoins coinsOld;
+    BOOST_CHECK(db.GetCoins(vTxid[1], coinsOld));
+    coins = coinsOld;
+    coins.nHeight = 200;
+    BOOST_CHECK(db.SetCoins(vTxid[1], coins));
+    BOOST_CHECK(writer.GetCoins(vTxid[1], coins));
+    BOOST_CHECK(coins == coinsOld);
+    // ... but only once, as the caller caches them
+    BOOST_CHECK(writer.GetCoins(vTxid[1], coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 200);
+
+    // Two more calls drop what the first one read
+    BOOST_CHECK_EQUAL(writer.Prefetch(std::vector<uint256>()), 0U);
+    BOOST_CHECK_EQUAL(writer.Prefetch(std::vector<uint256>()), 0U);
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_prefetch_threads)
+{
+    // Prefetch through worker threads from a writer with a batch in flight,
+    // which the lookups must see
+    CCoinsViewDBBlocking db;
+    CCoinsViewBackgroundWriter writer(db);
+    CCheckQueue<CCoinsPrefetch> queue(4);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCoinsPrefetch>::Thread, &queue));
+
+    std::map<uint256, CCoins> mapCoins;
+    std::vector<uint256> vStored, vNew, vTxid;
+    for (int i = 0; i < 50; i++) {
+        vStored.push_back(GetRandHash());
+        mapCoins[vStored.back()] = RandomCoins(i);
+        BOOST_CHECK(db.SetCoins(vStored.back(), mapCoins[vStored.back()]));
+    }
+    {
+        // The batch in flight spends some stored transactions, and adds new ones
+        CCoinsViewCache cacheWrite(writer);
+        for (int i = 0; i < 10; i++) {
+            mapCoins[vStored[i]].vout.clear();
+            cacheWrite.ModifyCoins(vStored[i])->vout.clear();
+        }
+        for (int i = 0; i < 50; i++) {
+            vNew.push_back(GetRandHash());
+            mapCoins[vNew.back()] = RandomCoins(100 + i);
+            *cacheWrite.ModifyCoins(vNew.back()) = mapCoins[vNew.back()];
+        }
+        BOOST_CHECK(cacheWrite.Flush());
+    }
+
+    CCoinsViewCacheTest cache(writer);
+    // An entry that is cached already is not fetched again
+    uint256 txidCached = vStored[20];
+    mapCoins[txidCached].vout.back().nValue++;
+    cache.ModifyCoins(txidCached)->vout.back().nValue++;
+
+    vTxid.insert(vTxid.end(), vStored.begin(), vStored.end());
+    vTxid.insert(vTxid.end(), vNew.begin(), vNew.end());
+    for (int i = 0; i < 10; i++)
+        vTxid.push_back(GetRandHash());
+    BOOST_CHECK_EQUAL(cache.Prefetch(vTxid, &queue), vTxid.size() - 1);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), vStored.size() + vNew.size());
+    BOOST_CHECK_EQUAL(cache.GetDirtyCacheSize(), 1U);
+    for (unsigned int i = 0; i < vTxid.size(); i++) {
+        const uint256 &txid = vTxid[i];
+        if (!mapCoins.count(txid)) {
+            // Unknown transactions are not cached
+            BOOST_CHECK_EQUAL(cache.GetFlags(txid), -1);
+        } else if (mapCoins[txid].IsPruned()) {
+            // Spent in the batch in flight: the database will not have them
+            BOOST_CHECK_EQUAL(cache.GetFlags(txid), CCoinsCacheEntry::FRESH);
+            BOOST_CHECK(cache.GetCoins(txid).IsPruned());
+        } else {
+            BOOST_CHECK_EQUAL(cache.GetFlags(txid), txid == txidCached ? CCoinsCacheEntry::DIRTY : 0);
+            BOOST_CHECK(cache.GetCoins(txid) == mapCoins[txid]);
+        }
+    }
+
+    // Once both are written, the database has the result of both
+    db.Release();
+    BOOST_CHECK(cache.Flush());
+    // The memory of a written batch is released
+    BOOST_CHECK(writer.Wait());
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+        if (!it->second.IsPruned())
+            BOOST_CHECK(coins == it->second);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 
 #include "util.h"
 #include "hash.h"
+#include "sha256.h"
 
 using namespace std;
 
@@ -41,4 +42,24 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Enough inputs to exercise every kernel and the scalar tail
+    for (unsigned int n = 0; n <= 21; n++)
+    {
+        vector<unsigned char> in(64 * n);
+        for (unsigned int i = 0; i < in.size(); i++)
+            in[i] = GetRand(256);
+        vector<unsigned char> out(32 * n + 1, 0x5a);
+        SHA256D64(&out[0], in.empty() ? NULL : &in[0], n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            uint256 hash = Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1));
+            BOOST_CHECK(memcmp(&out[32 * i], hash.begin(), 32) == 0);
+        }
+        // Nothing is written past the outputs
+        BOOST_CHECK_EQUAL(out[32 * n], 0x5a);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
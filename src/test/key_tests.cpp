@@ -138,4 +138,28 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_many)
+{
+    // Use more keys than the verifier keeps parsed, twice, so that both
+    // fresh and reused public keys are verified against.
+    vector<CKey> keys(100);
+    vector<vector<unsigned char> > sigs(keys.size());
+    string strMsg = "Very secret message";
+    uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+    uint256 hashOther = Hash(strMsg.begin(), strMsg.end() - 1);
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        keys[i].MakeNewKey(i % 2 == 0);
+        BOOST_CHECK(keys[i].Sign(hashMsg, sigs[i]));
+    }
+    for (int n = 0; n < 2; n++) {
+        for (unsigned int i = 0; i < keys.size(); i++) {
+            CPubKey pubkey = keys[i].GetPubKey();
+            BOOST_CHECK(pubkey.Verify(hashMsg, sigs[i]));
+            BOOST_CHECK(!pubkey.Verify(hashMsg, sigs[(i + 1) % keys.size()]));
+            BOOST_CHECK(!pubkey.Verify(hashOther, sigs[i]));
+        }
+    }
+    BOOST_CHECK(!keys[0].GetPubKey().Verify(hashMsg, vector<unsigned char>()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "chainparams.h"
 #include "init.h"
 #include "main.h"
 #include "uint256.h"
@@ -72,15 +73,41 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         pblock->vtx[0].vout[0].scriptPubKey = CScript();
         if (txFirst.size() < 2)
             txFirst.push_back(new CTransaction(pblock->vtx[0]));
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->hashMerkleRoot = pblock->ComputeMerkleRoot();
         pblock->nNonce = blockinfo[i].nonce;
         CValidationState state;
+        uint64 nHashes = 0;
+        CTransaction::pnHashCount = &nHashes;
         BOOST_CHECK(ProcessBlock(state, NULL, pblock));
+        CTransaction::pnHashCount = NULL;
         BOOST_CHECK(state.IsValid());
+        // Each transaction is hashed by CheckBlock when the block arrives,
+        // and again for the copy ConnectBlock reads back from disk. All
+        // other steps reuse those hashes.
+        BOOST_CHECK_EQUAL(nHashes, 2 * pblock->vtx.size());
         pblock->hashPrevBlock = pblock->GetHash();
     }
     delete pblocktemplate;
 
+    // The height index and the locator built from it match walking pprev
+    std::vector<uint256> vHave;
+    int nStep = 1;
+    for (CBlockIndex* pindex = pindexBest; pindex; ) {
+        BOOST_CHECK(FindBlockByHeight(pindex->nHeight) == pindex);
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(Params().HashGenesisBlock());
+    CDataStream ssLocator(SER_NETWORK, PROTOCOL_VERSION), ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssLocator << CBlockLocator(pindexBest);
+    ssExpected << CBlockLocator(vHave);
+    BOOST_CHECK(ssLocator.str() == ssExpected.str());
+    BOOST_CHECK(FindBlockByHeight(-1) == NULL);
+    BOOST_CHECK(FindBlockByHeight(pindexBest->nHeight + 1) == NULL);
+
     // Just to make sure we can still make simple blocks
     BOOST_CHECK(pblocktemplate = CreateNewBlockWithKey(reservekey));
     delete pblocktemplate;
@@ -206,6 +233,51 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         delete tx;
 }
 
+// Everything about an index entry that is loaded at startup
+static std::string DescribeBlockIndex(const CBlockIndex* pindex)
+{
+    return strprintf("%s %d %u %u %u %s %d %u %u %s %s %s",
+        pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, pindex->nStatus, pindex->nTx, pindex->nChainTx,
+        pindex->nChainWork.ToString().c_str(), pindex->nFile, pindex->nDataPos, pindex->nUndoPos,
+        pindex->GetBlockHeader().GetHash().ToString().c_str(),
+        pindex->pprev ? pindex->pprev->GetBlockHash().ToString().c_str() : "",
+        pindex->pskip ? pindex->pskip->GetBlockHash().ToString().c_str() : "");
+}
+
+static std::map<uint256, std::string> DescribeBlockIndex()
+{
+    std::map<uint256, std::string> mapDescribed;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        mapDescribed[item.first] = DescribeBlockIndex(item.second);
+    return mapDescribed;
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_snapshot)
+{
+    // Reload the chain built above, first from a snapshot and then, as the
+    // snapshot is only used once, from the block tree database
+    std::map<uint256, std::string> mapBefore = DescribeBlockIndex();
+    size_t nValid = setBlockIndexValid.size();
+    uint256 hashBest = hashBestChain;
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(PrepareBlockIndexSnapshot(ssSnapshot));
+    BOOST_CHECK(WriteBlockIndexSnapshot(ssSnapshot));
+
+    // The coins view refers to index entries, so write it out and forget them
+    BOOST_CHECK(pcoinsTip->Flush());
+    BOOST_CHECK(WaitForCoinsWriter());
+    for (int i = 0; i < 2; i++) {
+        pcoinsTip->SetBestBlock(NULL);
+        UnloadBlockIndex();
+        BOOST_CHECK(LoadBlockIndex());
+        BOOST_CHECK(InitBlockIndex());
+        BOOST_CHECK(DescribeBlockIndex() == mapBefore);
+        BOOST_CHECK_EQUAL(setBlockIndexValid.size(), nValid);
+        BOOST_CHECK(hashBestChain == hashBest);
+        BOOST_CHECK(pindexBest && pindexBest->GetBlockHash() == hashBest);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
@@ -36,6 +36,26 @@ BOOST_AUTO_TEST_CASE(pmt_test1)
 
         // calculate actual merkle root and height
         uint256 merkleRoot1 = block.BuildMerkleTree();
+
+        // the root-only computation must agree, and branches must still work
+        // after it, although it does not keep the inner nodes
+        unsigned int nIndices[2] = {rand() % nTx, nTx - 1};
+        std::vector<uint256> vBranch[2];
+        for (int k = 0; k < 2; k++)
+            vBranch[k] = block.GetMerkleBranch(nIndices[k]);
+        BOOST_CHECK(block.ComputeMerkleRoot() == merkleRoot1);
+        CBlock blockNoTree(block);
+        blockNoTree.vMerkleTree.clear();
+        for (int k = 0; k < 2; k++) {
+            unsigned int nIndex = nIndices[k];
+            BOOST_CHECK(CBlock::CheckMerkleBranch(block.GetTxHash(nIndex), block.GetMerkleBranch(nIndex), nIndex) == merkleRoot1);
+            // branches are computed without filling in the tree, as blocks
+            // from ReadBlockFromDiskCached are shared between threads
+            BOOST_CHECK(block.GetMerkleBranch(nIndex) == vBranch[k]);
+            BOOST_CHECK(blockNoTree.GetMerkleBranch(nIndex) == vBranch[k]);
+        }
+        BOOST_CHECK_EQUAL(block.vMerkleTree.size(), nTx);
+        BOOST_CHECK(blockNoTree.vMerkleTree.empty());
         std::vector<uint256> vTxid(nTx, 0);
         for (unsigned int j=0; j<nTx; j++)
             vTxid[j] = block.vtx[j].GetHash();
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <fstream>
+#include <set>
 #include <vector>
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/predicate.hpp>
@@ -183,6 +184,124 @@ BOOST_AUTO_TEST_CASE(script_PushData)
     BOOST_CHECK(pushdata4Stack == directStack);
 }
 
+// Evaluate strScript on the stack that strBefore leaves, and check that the
+// result is the stack that strAfter leaves
+static bool CheckStack(const string &strBefore, const string &strScript, const string &strAfter, unsigned int flagsEval = flags)
+{
+    vector<vector<unsigned char> > stack, stackExpected;
+    BOOST_REQUIRE(EvalScript(stack, ParseScript(strBefore), CTransaction(), 0, flagsEval, 0));
+    BOOST_REQUIRE(EvalScript(stackExpected, ParseScript(strAfter), CTransaction(), 0, flagsEval, 0));
+    if (!EvalScript(stack, ParseScript(strScript), CTransaction(), 0, flagsEval, 0))
+        return false;
+    BOOST_CHECK_MESSAGE(stack == stackExpected, strBefore + " | " + strScript + " != " + strAfter);
+    return true;
+}
+
+// Evaluating strScript must fail on the stack that strBefore leaves
+static bool CheckStackFails(const string &strBefore, const string &strScript)
+{
+    vector<vector<unsigned char> > stack;
+    BOOST_REQUIRE(EvalScript(stack, ParseScript(strBefore), CTransaction(), 0, flags, 0));
+    return !EvalScript(stack, ParseScript(strScript), CTransaction(), 0, flags, 0);
+}
+
+BOOST_AUTO_TEST_CASE(script_stack_shape)
+{
+    // Elements of different sizes, so that moving the wrong one shows
+    BOOST_CHECK(CheckStack("1 2 3 4 5 6", "2ROT", "3 4 5 6 1 2"));
+    BOOST_CHECK(CheckStack("1000 2 30000 4 500000 6 7", "2ROT", "1000 30000 4 500000 6 7 2"));
+    BOOST_CHECK(CheckStack("1 2 3 4 5 6", "2ROT 2ROT 2ROT", "1 2 3 4 5 6"));
+    BOOST_CHECK(CheckStackFails("1 2 3 4 5", "2ROT"));
+
+    BOOST_CHECK(CheckStack("1000 20000 3", "0 ROLL", "1000 20000 3"));
+    BOOST_CHECK(CheckStack("1000 20000 3", "1 ROLL", "1000 3 20000"));
+    BOOST_CHECK(CheckStack("1000 20000 3", "2 ROLL", "20000 3 1000"));
+    BOOST_CHECK(CheckStack("7 1000 20000 3", "2 ROLL", "7 20000 3 1000"));
+    BOOST_CHECK(CheckStackFails("1000 20000 3", "3 ROLL"));
+    BOOST_CHECK(CheckStackFails("1000 20000 3", "-1 ROLL"));
+    BOOST_CHECK(CheckStack("1000 20000 3", "0 PICK", "1000 20000 3 3"));
+    BOOST_CHECK(CheckStack("1000 20000 3", "2 PICK", "1000 20000 3 1000"));
+    BOOST_CHECK(CheckStackFails("1000 20000 3", "3 PICK"));
+
+    BOOST_CHECK(CheckStack("1000 20000 3", "NIP", "1000 3"));
+    BOOST_CHECK(CheckStack("20000 3", "NIP", "3"));
+    BOOST_CHECK(CheckStackFails("3", "NIP"));
+
+    BOOST_CHECK(CheckStack("1000 20000 3", "TUCK", "1000 3 20000 3"));
+    BOOST_CHECK(CheckStack("20000 3", "TUCK", "3 20000 3"));
+    BOOST_CHECK(CheckStackFails("3", "TUCK"));
+
+    BOOST_CHECK(CheckStack("1000 20000", "2DUP", "1000 20000 1000 20000"));
+    BOOST_CHECK(CheckStack("1000 20000 3", "3DUP", "1000 20000 3 1000 20000 3"));
+    BOOST_CHECK(CheckStack("1000 20000 3 4", "2OVER", "1000 20000 3 4 1000 20000"));
+    BOOST_CHECK(CheckStack("1000 20000", "OVER", "1000 20000 1000"));
+    BOOST_CHECK(CheckStack("1000", "DUP", "1000 1000"));
+    BOOST_CHECK(CheckStack("1000", "IFDUP", "1000 1000"));
+    BOOST_CHECK(CheckStack("1000 0", "IFDUP", "1000 0"));
+
+    // The alt stack keeps whole elements, in order
+    BOOST_CHECK(CheckStack("1000 20000 3", "TOALTSTACK TOALTSTACK FROMALTSTACK", "1000 20000"));
+    BOOST_CHECK(CheckStack("1000 20000 3", "TOALTSTACK TOALTSTACK 7 FROMALTSTACK FROMALTSTACK", "1000 7 20000 3"));
+    BOOST_CHECK(CheckStackFails("1000", "FROMALTSTACK"));
+    BOOST_CHECK(CheckStackFails("1000", "TOALTSTACK FROMALTSTACK FROMALTSTACK"));
+
+    // Results replace their arguments, leaving the rest of the stack alone
+    BOOST_CHECK(CheckStack("7 1000 1000", "EQUAL", "7 1"));
+    BOOST_CHECK(CheckStack("7 1000 20000", "EQUAL", "7 0"));
+    BOOST_CHECK(CheckStack("7 1000 1000", "EQUALVERIFY", "7"));
+    BOOST_CHECK(CheckStack("7 1000", "NEGATE", "7 -1000"));
+    BOOST_CHECK(CheckStack("7 1000", "1ADD", "7 1001"));
+    BOOST_CHECK(CheckStack("7 1000", "NOT", "7 0"));
+    BOOST_CHECK(CheckStack("7 1000 20000", "ADD", "7 21000"));
+    BOOST_CHECK(CheckStack("7 1000 1000", "NUMEQUAL", "7 1"));
+    BOOST_CHECK(CheckStack("7 1000 1000", "NUMEQUALVERIFY", "7"));
+    BOOST_CHECK(CheckStack("7 1000 20000", "MAX", "7 20000"));
+    BOOST_CHECK(CheckStack("7 5 1 10", "WITHIN", "7 1"));
+    BOOST_CHECK(CheckStack("7 10 1 10", "WITHIN", "7 0"));
+    BOOST_CHECK(CheckStack("7 0", "SHA256", "7 0x20 0xe3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+    BOOST_CHECK(CheckStack("7 0 0", "CHECKSIG", "7 0", SCRIPT_VERIFY_NONE));
+    BOOST_CHECK(CheckStack("7 0 0 0", "CHECKMULTISIG", "7 1"));
+    BOOST_CHECK(CheckStack("7 0 0 0x21 0x02aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa 1", "CHECKMULTISIG", "7 1"));
+    BOOST_CHECK(CheckStack("7 0 0 1 0x21 0x02aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa 1", "CHECKMULTISIG", "7 0", SCRIPT_VERIFY_NONE));
+    BOOST_CHECK(CheckStackFails("0 0", "CHECKMULTISIG"));
+}
+
+// Whether evaluating strScript on the stack that strBefore leaves succeeds
+// and leaves only elements that live in buffers the stack had before: they
+// were moved, or overwritten in place, but not copied
+static bool CheckStackMoves(const string &strBefore, const string &strScript)
+{
+    vector<vector<unsigned char> > stack;
+    BOOST_REQUIRE(EvalScript(stack, ParseScript(strBefore), CTransaction(), 0, flags, 0));
+    set<const unsigned char*> setBuffers;
+    BOOST_FOREACH(const vector<unsigned char> &vch, stack)
+        setBuffers.insert(&vch[0]);
+    if (!EvalScript(stack, ParseScript(strScript), CTransaction(), 0, flags, 0))
+        return false;
+    BOOST_FOREACH(const vector<unsigned char> &vch, stack)
+        if (vch.empty() || !setBuffers.count(&vch[0]))
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(script_stack_moves)
+{
+    // Moving elements around the stack doesn't copy them, and results reuse
+    // the buffer of an argument
+    static const char *pszStack = "1000 20000 3000000 4 500000 6";
+    BOOST_CHECK(CheckStackMoves(pszStack, ""));
+    BOOST_CHECK(CheckStackMoves(pszStack, "2ROT 2ROT 2ROT"));
+    BOOST_CHECK(CheckStackMoves(pszStack, "4 ROLL"));
+    BOOST_CHECK(CheckStackMoves(pszStack, "NIP NIP"));
+    BOOST_CHECK(CheckStackMoves(pszStack, "SWAP ROT 2SWAP"));
+    BOOST_CHECK(CheckStackMoves(pszStack, "TOALTSTACK TOALTSTACK FROMALTSTACK FROMALTSTACK TOALTSTACK FROMALTSTACK"));
+    BOOST_CHECK(CheckStackMoves(pszStack, "6 EQUAL"));
+    BOOST_CHECK(CheckStackMoves(pszStack, "2DROP 2DROP 20000 EQUAL"));
+    // Copies get buffers of their own
+    BOOST_CHECK(!CheckStackMoves(pszStack, "DUP"));
+    BOOST_CHECK(!CheckStackMoves(pszStack, "TUCK"));
+}
+
 CScript
 sign_multisig(CScript scriptPubKey, std::vector<CKey> keys, CTransaction transaction)
 {
@@ -431,4 +550,34 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_sighash_cache)
+{
+    for (int n = 0; n < 20; n++) {
+        CTransaction txTo;
+        txTo.nVersion = GetRand(0x7FFFFFFF);
+        txTo.nLockTime = GetRand(2) ? GetRand(0xFFFFFFFF) : 0;
+        txTo.vin.resize(1 + GetRand(10));
+        txTo.vout.resize(GetRand(10));
+        for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+            txTo.vin[i].prevout = COutPoint(GetRandHash(), GetRand(4));
+            txTo.vin[i].scriptSig = CScript() << std::vector<unsigned char>(GetRand(80), 0x01);
+            txTo.vin[i].nSequence = GetRand(2) ? GetRand(0xFFFFFFFF) : std::numeric_limits<unsigned int>::max();
+        }
+        for (unsigned int i = 0; i < txTo.vout.size(); i++) {
+            txTo.vout[i].nValue = GetRand(100000000);
+            txTo.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+
+        CSignatureHashCache cache(txTo);
+        CScript scriptCode = CScript() << OP_1 << OP_CODESEPARATOR << OP_CHECKSIG;
+        for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+            for (int nHashType = 0; nHashType < 4; nHashType++) {
+                BOOST_CHECK(cache.SignatureHash(scriptCode, txTo, i, nHashType) == SignatureHash(scriptCode, txTo, i, nHashType));
+                BOOST_CHECK(cache.SignatureHash(scriptCode, txTo, i, nHashType | SIGHASH_ANYONECANPAY) ==
+                            SignatureHash(scriptCode, txTo, i, nHashType | SIGHASH_ANYONECANPAY));
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
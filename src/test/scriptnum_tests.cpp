@@ -0,0 +1,167 @@
+#include <boost/test/unit_test.hpp>
+#include <limits>
+#include <vector>
+
+#include "bignum.h"
+#include "script.h"
+#include "util.h"
+
+// CScriptNum replaced CBigNum in the script interpreter, so it must behave
+// exactly the same way on everything EvalScript does with numbers.
+
+BOOST_AUTO_TEST_SUITE(scriptnum_tests)
+
+static const int64 values[] = \
+{ 0, 1, -2, 127, 128, -255, 256, (1LL << 15) - 1, -(1LL << 16), (1LL << 24) - 1, (1LL << 31), 1 - (1LL << 32), 1LL << 40 };
+static const int64 offsets[] = { 1, 0x79, 0x80, 0x81, 0xFF, 0x7FFF, 0x8000, 0xFFFF, 0x10000};
+
+// Same as the interpreter used to do: reject oversized operands, then
+// normalize through a round trip.
+static CBigNum CastToBigNum(const std::vector<unsigned char>& vch)
+{
+    if (vch.size() > CScriptNum::nMaxNumSize)
+        throw std::runtime_error("CastToBigNum() : overflow");
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+static bool verify(const CBigNum& bignum, const CScriptNum& scriptnum)
+{
+    return bignum.getvch() == scriptnum.getvch() && bignum.getint() == scriptnum.getint();
+}
+
+static void CheckCreateVch(const std::vector<unsigned char>& vch)
+{
+    bool fBigNumThrew = false, fScriptNumThrew = false;
+    CBigNum bignum;
+    try {
+        bignum = CastToBigNum(vch);
+    } catch (std::runtime_error &e) {
+        fBigNumThrew = true;
+    }
+    try {
+        CScriptNum scriptnum(vch);
+        BOOST_CHECK(!fBigNumThrew && verify(bignum, scriptnum));
+    } catch (scriptnum_error &e) {
+        fScriptNumThrew = true;
+    }
+    BOOST_CHECK_EQUAL(fBigNumThrew, fScriptNumThrew);
+}
+
+static void CheckCreateInt(int64 num)
+{
+    BOOST_CHECK(verify(CBigNum(num), CScriptNum(num)));
+    // Only values that fit in an operand can be read back
+    std::vector<unsigned char> vch = CScriptNum(num).getvch();
+    BOOST_CHECK(vch == CBigNum(num).getvch());
+    CheckCreateVch(vch);
+}
+
+static void CheckArithmetic(int64 num1, int64 num2)
+{
+    const CBigNum bignum1(num1), bignum2(num2);
+    const CScriptNum scriptnum1(num1), scriptnum2(num2);
+
+    BOOST_CHECK(verify(bignum1 + bignum2, scriptnum1 + scriptnum2));
+    BOOST_CHECK(verify(bignum1 - bignum2, scriptnum1 - scriptnum2));
+    BOOST_CHECK(verify(bignum2 - bignum1, scriptnum2 - scriptnum1));
+    BOOST_CHECK(verify(-bignum1, -scriptnum1));
+
+    CBigNum bignum3(bignum1);
+    CScriptNum scriptnum3(scriptnum1);
+    bignum3 += bignum2;
+    scriptnum3 += scriptnum2;
+    BOOST_CHECK(verify(bignum3, scriptnum3));
+    bignum3 -= bignum2;
+    scriptnum3 -= scriptnum2;
+    BOOST_CHECK(verify(bignum3, scriptnum3));
+}
+
+static void CheckCompare(int64 num1, int64 num2)
+{
+    const CBigNum bignum1(num1), bignum2(num2);
+    const CScriptNum scriptnum1(num1), scriptnum2(num2);
+
+    BOOST_CHECK((bignum1 == bignum2) == (scriptnum1 == scriptnum2));
+    BOOST_CHECK((bignum1 != bignum2) == (scriptnum1 != scriptnum2));
+    BOOST_CHECK((bignum1 <  bignum2) == (scriptnum1 <  scriptnum2));
+    BOOST_CHECK((bignum1 >  bignum2) == (scriptnum1 >  scriptnum2));
+    BOOST_CHECK((bignum1 >= bignum2) == (scriptnum1 >= scriptnum2));
+    BOOST_CHECK((bignum1 <= bignum2) == (scriptnum1 <= scriptnum2));
+
+    BOOST_CHECK((bignum1 == bignum2) == (scriptnum1 == num2));
+    BOOST_CHECK((bignum1 <  bignum2) == (scriptnum1 <  num2));
+    BOOST_CHECK((bignum1 >= bignum2) == (scriptnum1 >= num2));
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_creation)
+{
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); ++j)
+        {
+            CheckCreateInt(values[i]);
+            CheckCreateInt(values[i] + offsets[j]);
+            CheckCreateInt(values[i] - offsets[j]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_operators)
+{
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); ++j)
+        {
+            CheckArithmetic(values[i], values[j]);
+            CheckArithmetic(values[i], -values[j]);
+            CheckArithmetic(values[i] + values[j], values[j]);
+            CheckArithmetic(values[i] + values[j], values[j] + offsets[j]);
+            CheckCompare(values[i], values[j]);
+            CheckCompare(values[i], -values[j]);
+            CheckCompare(values[i] + offsets[j], values[j]);
+            CheckCompare(values[i], values[j] - offsets[j]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_decode_exhaustive)
+{
+    // Every encoding of up to two bytes, including non-minimal ones and
+    // negative zeroes
+    std::vector<unsigned char> vch;
+    CheckCreateVch(vch);
+    for (unsigned int n = 0; n < 0x100; n++)
+    {
+        CheckCreateVch(std::vector<unsigned char>(1, n));
+        for (unsigned int m = 0; m < 0x100; m++)
+        {
+            vch.resize(2);
+            vch[0] = n;
+            vch[1] = m;
+            CheckCreateVch(vch);
+        }
+    }
+
+    // Random encodings of three to five bytes
+    for (int i = 0; i < 100000; i++)
+    {
+        vch.resize(3 + GetRand(3));
+        for (unsigned int j = 0; j < vch.size(); j++)
+            vch[j] = GetRand(0x100);
+        // Make trailing (non-minimal) zeroes and sign bytes likely
+        if (GetRand(4) == 0)
+            vch.back() = GetRand(2) ? 0x80 : 0;
+        CheckCreateVch(vch);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_getint)
+{
+    // getint() saturates like CBigNum's for results that do not fit
+    const int64 limits[] = { std::numeric_limits<int>::max(), std::numeric_limits<int>::min(), 1LL << 32, -(1LL << 32) };
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); ++i)
+        for (int64 d = -2; d <= 2; d++)
+            BOOST_CHECK_EQUAL(CBigNum(limits[i] + d).getint(), CScriptNum(limits[i] + d).getint());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
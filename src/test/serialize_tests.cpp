@@ -42,4 +42,26 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(bufferreader)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<int> v(10, 7);
+    std::string str("CBufferReader");
+    ss << v << str << VARINT(12345);
+
+    CBufferReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, 0);
+    std::vector<int> v2;
+    std::string str2;
+    int n = 0;
+    reader >> v2 >> str2 >> VARINT(n);
+    BOOST_CHECK(v2 == v);
+    BOOST_CHECK(str2 == str);
+    BOOST_CHECK(n == 12345);
+    BOOST_CHECK(reader.empty());
+
+    // reading past the end throws instead of touching foreign memory
+    CBufferReader truncated(&ss[0], &ss[0] + 3, SER_DISK, 0);
+    BOOST_CHECK_THROW(truncated >> v2, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
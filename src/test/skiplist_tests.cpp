@@ -0,0 +1,74 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "main.h"
+#include "util.h"
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = insecure_rand() % (SKIPLIST_LENGTH - 1);
+        int to = insecure_rand() % (from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_branches)
+{
+    // A main chain with branches forking off at random heights; ancestors
+    // below the fork are on the main chain, above it on the branch
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH / 10);
+    for (unsigned int i=0; i<vIndex.size(); i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int n=0; n < 100; n++) {
+        int nFork = insecure_rand() % vIndex.size();
+        std::vector<CBlockIndex> vBranch(1 + insecure_rand() % 1000);
+        for (unsigned int i=0; i<vBranch.size(); i++) {
+            vBranch[i].nHeight = nFork + 1 + i;
+            vBranch[i].pprev = (i == 0) ? &vIndex[nFork] : &vBranch[i - 1];
+            vBranch[i].BuildSkip();
+        }
+
+        const CBlockIndex& tip = vBranch.back();
+        for (int i=0; i < 100; i++) {
+            int nHeight = insecure_rand() % (tip.nHeight + 1);
+            if (nHeight <= nFork)
+                BOOST_CHECK(tip.GetAncestor(nHeight) == &vIndex[nHeight]);
+            else
+                BOOST_CHECK(tip.GetAncestor(nHeight) == &vBranch[nHeight - nFork - 1]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
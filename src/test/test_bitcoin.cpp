@@ -22,13 +22,15 @@ struct TestingSetup {
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
+        InitSignatureCache(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
         bitdb.MakeMock();
         pathTemp = GetTempPath() / strprintf("test_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
         boost::filesystem::create_directories(pathTemp);
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        pcoinswriter = new CCoinsViewBackgroundWriter(*pcoinsdbview);
+        pcoinsTip = new CCoinsViewCache(*pcoinswriter);
         InitBlockIndex();
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -37,6 +39,8 @@ struct TestingSetup {
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i < nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
     }
     ~TestingSetup()
     {
@@ -45,6 +49,8 @@ struct TestingSetup {
         delete pwalletMain;
         pwalletMain = NULL;
         delete pcoinsTip;
+        delete pcoinswriter;
+        pcoinswriter = NULL;
         delete pcoinsdbview;
         delete pblocktree;
         bitdb.Flush(true);
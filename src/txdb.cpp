@@ -7,42 +7,246 @@
 #include "main.h"
 #include "hash.h"
 #include "chainparams.h"
+#include "ui_interface.h"
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+// Coins are stored one unspent output per record, under the key
+// ('o', COutPoint(txid, n)), so updating a transaction only touches the
+// outputs that were created or spent. Every transaction with unspent outputs
+// also has a small record under ('o', txid), which sorts right before its
+// outputs, saying which of them are unspent. A lookup first reads that
+// record, which the bloom filters answer without disk access for the many
+// transactions that are not in the database (as when checking that a new
+// transaction doesn't exist yet). If it is there, the outputs follow in the
+// same table block, which the read has just put in the block cache.
+static const unsigned int COINS_TX_KEY_SIZE = 1 + 32;
+static const unsigned int COINS_OUTPUT_KEY_SIZE = 1 + 32 + 4;
+
+// Version of the format above, stored under 'V'. Databases without it are
+// either new or in the old format with one ('c', txid) record per
+// transaction, which CCoinsViewDB::Upgrade converts. The best block moves
+// from 'B' to 'H' with the conversion, so earlier versions don't take a
+// converted database for theirs: without a best block, they rebuild their
+// records from the genesis block.
+static const int COINS_DB_VERSION = 2;
+
+namespace {
+
+/** The value of an output record: the output itself, plus the metadata of
+ *  its transaction, repeated in every output so each can be written alone. */
+class CCoinsOutput
+{
+public:
+    int nTxVersion;
+    bool fCoinBase;
+    int nHeight;
+    CTxOut txout;
+
+    CCoinsOutput() : nTxVersion(0), fCoinBase(false), nHeight(0), txout() {}
+    CCoinsOutput(const CCoins &coins, unsigned int n) : nTxVersion(coins.nVersion), fCoinBase(coins.fCoinBase), nHeight(coins.nHeight), txout(coins.vout[n]) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return ::GetSerializeSize(VARINT(nTxVersion), nType, nVersion) +
+               ::GetSerializeSize(VARINT(nHeight*2+(fCoinBase ? 1 : 0)), nType, nVersion) +
+               ::GetSerializeSize(CTxOutCompressor(REF(txout)), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, VARINT(nTxVersion), nType, nVersion);
+        ::Serialize(s, VARINT(nHeight*2+(fCoinBase ? 1 : 0)), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(txout)), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(nTxVersion), nType, nVersion);
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        ::Unserialize(s, REF(CTxOutCompressor(REF(txout))), nType, nVersion);
+    }
+};
+
+/** The value of a transaction record: the metadata of the transaction, and
+ *  a bitmask of its unspent outputs. */
+class CCoinsTxRecord
+{
+public:
+    int nTxVersion;
+    bool fCoinBase;
+    int nHeight;
+    // Bit n%8 of byte n/8 is set if output n is unspent; the last byte is
+    // never zero
+    std::vector<unsigned char> vAvail;
+
+    CCoinsTxRecord() : nTxVersion(0), fCoinBase(false), nHeight(0) {}
+
+    explicit CCoinsTxRecord(const CCoins &coins) : nTxVersion(coins.nVersion), fCoinBase(coins.fCoinBase), nHeight(coins.nHeight) {
+        for (unsigned int n = 0; n < coins.vout.size(); n++) {
+            if (coins.vout[n].IsNull())
+                continue;
+            vAvail.resize(n / 8 + 1);
+            vAvail[n / 8] |= 1 << (n % 8);
+        }
+    }
+
+    // The record a cache entry last saw stored; its version and coinbase
+    // flag cannot differ from the current coins if any output is stored
+    CCoinsTxRecord(const CCoinsCacheEntry &entry) : nTxVersion(entry.coins.nVersion), fCoinBase(entry.coins.fCoinBase), nHeight(entry.nStoredHeight) {
+        for (unsigned int n = 0; n < 64; n++) {
+            if (!(entry.nStoredMask & ((uint64)1 << n)))
+                continue;
+            vAvail.resize(n / 8 + 1);
+            vAvail[n / 8] |= 1 << (n % 8);
+        }
+    }
+
+    bool IsEmpty() const {
+        return vAvail.empty();
+    }
+
+    // One more than the highest output that may be unspent
+    unsigned int GetSize() const {
+        return vAvail.size() * 8;
+    }
+
+    bool IsAvailable(unsigned int n) const {
+        return n / 8 < vAvail.size() && (vAvail[n / 8] & (1 << (n % 8)));
+    }
+
+    bool IsSameTx(const CCoinsTxRecord &other) const {
+        return nTxVersion == other.nTxVersion && fCoinBase == other.fCoinBase && nHeight == other.nHeight;
+    }
+
+    IMPLEMENT_SERIALIZE(
+        unsigned int nCode = nHeight*2+(fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nTxVersion));
+        READWRITE(VARINT(nCode));
+        READWRITE(vAvail);
+        if (fRead) {
+            CCoinsTxRecord *pthis = const_cast<CCoinsTxRecord*>(this);
+            pthis->nHeight = nCode / 2;
+            pthis->fCoinBase = nCode & 1;
+        }
+    )
+};
+
+}
+
+// Collect the outputs of txid, starting at the cursor, which is left on the
+// first record after them. Returns false if the cursor is not on an output
+// of txid. pnSize, if given, is increased by the size of the records read.
+bool static ReadCoinsOutputs(leveldb::Iterator *pcursor, const uint256 &txid, CCoins &coins, uint64 *pnSize = NULL) {
+    coins = CCoins();
+    bool fFound = false;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != COINS_OUTPUT_KEY_SIZE || slKey[0] != 'o' || memcmp(slKey.data() + 1, txid.begin(), 32) != 0)
+            break;
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        COutPoint outpoint;
+        ssKey >> chType >> outpoint;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutput output;
+        ssValue >> output;
+        if (outpoint.n >= coins.vout.size())
+            coins.vout.resize(outpoint.n + 1);
+        coins.vout[outpoint.n] = output.txout;
+        coins.nVersion = output.nTxVersion;
+        coins.fCoinBase = output.fCoinBase;
+        coins.nHeight = output.nHeight;
+        if (pnSize)
+            *pnSize += slKey.size() - 1 + slValue.size();
+        fFound = true;
+    }
+    return fFound;
+}
+
+// Read the stored outputs of txid. Throws if they don't match its record.
+bool static ReadCoins(CLevelDB &db, const uint256 &txid, CCoins &coins) {
+    coins = CCoins();
+    CCoinsTxRecord record;
+    if (!db.Read(make_pair('o', txid), record))
+        return false;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair('o', txid);
+    leveldb::Iterator *pcursor = db.NewCachingIterator();
+    pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+    if (pcursor->Valid())
+        pcursor->Next();
+    try {
+        ReadCoinsOutputs(pcursor, txid, coins);
+    } catch (std::exception &e) {
+        delete pcursor;
+        throw leveldb_error("Database corrupted");
+    }
+    leveldb::Status status = pcursor->status();
+    delete pcursor;
+    HandleError(status);
+    if (coins.nVersion != record.nTxVersion || coins.fCoinBase != record.fCoinBase || coins.nHeight != record.nHeight || CCoinsTxRecord(coins).vAvail != record.vAvail)
+        HandleError(leveldb::Status::Corruption("coin database outputs don't match their transaction", txid.ToString()));
+    return true;
+}
+
+// Queue the writes that turn the stored outputs of txid, described by
+// recordOld, into coins: outputs that were spent are erased, and only new
+// ones are written. Outputs never change while unspent, so those that stay
+// are not rewritten, unless the transaction was replaced altogether.
+void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoinsTxRecord &recordOld, const CCoins &coins) {
+    CCoinsTxRecord record(coins);
+    bool fSameTx = recordOld.IsSameTx(record);
+    unsigned int nSize = std::max((unsigned int)recordOld.GetSize(), (unsigned int)coins.vout.size());
+    for (unsigned int n = 0; n < nSize; n++) {
+        bool fOld = recordOld.IsAvailable(n);
+        bool fNew = record.IsAvailable(n);
+        if (fNew) {
+            if (!fOld || !fSameTx)
+                batch.Write(make_pair('o', COutPoint(hash, n)), CCoinsOutput(coins, n));
+        } else if (fOld) {
+            batch.Erase(make_pair('o', COutPoint(hash, n)));
+        }
+    }
+    if (record.IsEmpty()) {
+        if (!recordOld.IsEmpty())
+            batch.Erase(make_pair('o', hash));
+    } else if (!fSameTx || record.vAvail != recordOld.vAvail) {
+        batch.Write(make_pair('o', hash), record);
+    }
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
-    batch.Write('B', hash);
+    batch.Write('H', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBOptions &dboptions) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, dboptions) {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
-    return db.Read(make_pair('c', txid), coins); 
+bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
+    return ReadCoins(db, txid, coins);
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
+    CCoinsTxRecord recordOld;
+    db.Read(make_pair('o', txid), recordOld);
     CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
+    BatchWriteCoins(batch, txid, recordOld, coins);
     return db.WriteBatch(batch);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
-    return db.Exists(make_pair('c', txid)); 
+    return db.Exists(make_pair('o', txid));
 }
 
 CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read('H', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -54,19 +258,148 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    LogPrint("coindb", "Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    size_t count = 0, nReadBack = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            // Nothing is stored yet for fresh entries, and the cache usually
+            // knows which outputs are stored for the others. Only read the
+            // record back when it does not.
+            CCoinsTxRecord recordOld;
+            if (it->second.IsStoredKnown()) {
+                recordOld = CCoinsTxRecord(it->second);
+            } else if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+                db.Read(make_pair('o', it->first), recordOld);
+                nReadBack++;
+            }
+            BatchWriteCoins(batch, it->first, recordOld, it->second.coins);
+            count++;
+        }
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
+    LogPrint("coindb", "Committing %u changed transactions (out of %u, %u read back) to coin database...\n", (unsigned int)count, (unsigned int)mapCoins.size(), (unsigned int)nReadBack);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+// Erase all records whose type is chType, in batches
+void static EraseRecords(CLevelDB &db, char chType) {
+    leveldb::Iterator *pcursor = db.NewIterator();
+    pcursor->Seek(leveldb::Slice(&chType, 1));
+    try {
+        while (pcursor->Valid() && pcursor->key()[0] == chType) {
+            CLevelDBBatch batch;
+            for (int i = 0; i < 10000 && pcursor->Valid() && pcursor->key()[0] == chType; i++, pcursor->Next()) {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chKeyType;
+                uint256 txid;
+                ssKey >> chKeyType >> txid;
+                if (ssKey.empty()) {
+                    batch.Erase(make_pair(chType, txid));
+                } else {
+                    unsigned int n;
+                    ssKey >> n;
+                    batch.Erase(make_pair(chType, COutPoint(txid, n)));
+                }
+            }
+            db.WriteBatch(batch);
+        }
+    } catch (std::exception &e) {
+        delete pcursor;
+        throw;
+    }
+    leveldb::Status status = pcursor->status();
+    delete pcursor;
+    HandleError(status);
+}
+
+bool CCoinsViewDB::Upgrade() {
+    int nVersion = 0;
+    if (db.Read('V', nVersion)) {
+        if (nVersion != COINS_DB_VERSION)
+            return error("%s() : unknown coin database version %d", __PRETTY_FUNCTION__, nVersion);
+        // Only versions before this format write 'B'. If it is back, one of
+        // them has written its own records since, and both are incomplete.
+        if (db.Exists('B'))
+            return error("%s() : coin database was modified by an earlier version", __PRETTY_FUNCTION__);
+        // Without 'B', old records are left by an interrupted conversion
+        try {
+            EraseRecords(db, 'c');
+        } catch (leveldb_error &e) {
+            throw;
+        } catch (std::exception &e) {
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        return true;
+    }
+
+    // Before, all the outputs of a transaction were stored together as a
+    // CCoins, under the key ('c', txid), and the best block under 'B'. The
+    // new records are added next to the old ones, which earlier versions can
+    // keep using until the switch. A single batch then moves the best block
+    // to 'H' and writes the version, after which the old records are erased.
+    leveldb::Iterator *pcursor = db.NewIterator();
+    pcursor->Seek(leveldb::Slice("c", 1));
+    bool fOld = pcursor->Valid() && pcursor->key()[0] == 'c';
+    if (fOld) {
+        uiInterface.InitMessage(_("Upgrading chainstate database..."));
+        LogPrintf("Upgrading coin database to one record per output...\n");
+    }
+    int64 nStart = GetTimeMillis();
+    uint64 nTransactions = 0;
+    try {
+        // Outputs left by an interrupted conversion are stale if an earlier
+        // version has changed the old records since
+        EraseRecords(db, 'o');
+
+        while (pcursor->Valid() && pcursor->key()[0] == 'c') {
+            CLevelDBBatch batch;
+            for (int i = 0; i < 10000 && pcursor->Valid() && pcursor->key()[0] == 'c'; i++, pcursor->Next()) {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                uint256 txid;
+                ssKey >> chType >> txid;
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                BatchWriteCoins(batch, txid, CCoinsTxRecord(), coins);
+                nTransactions++;
+            }
+            db.WriteBatch(batch);
+        }
+        if (!pcursor->status().ok())
+            HandleError(pcursor->status());
+        delete pcursor;
+        pcursor = NULL;
+
+        CLevelDBBatch batch;
+        uint256 hashBestChain;
+        if (db.Read('B', hashBestChain)) {
+            BatchWriteHashBestChain(batch, hashBestChain);
+            batch.Erase('B');
+        }
+        batch.Write('V', COINS_DB_VERSION);
+        db.WriteBatch(batch, true);
+
+        EraseRecords(db, 'c');
+    } catch (leveldb_error &e) {
+        delete pcursor;
+        throw;
+    } catch (std::exception &e) {
+        delete pcursor;
+        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
+    if (fOld)
+        LogPrintf("Upgraded %"PRI64u" transactions in %"PRI64d"ms\n", nTransactions, GetTimeMillis() - nStart);
+    return true;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBOptions &dboptions) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, dboptions) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -112,57 +445,228 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
+namespace {
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+/** One slice of the coin database for CCoinsViewDB::GetStats: the coins whose
+ *  txid starts with a given byte, serialized the way they are hashed. */
+struct CCoinsStatsRange
+{
+    bool fDone;
+    bool fError;
+    boost::shared_ptr<CDataStream> pss;
+    uint64 nTransactions;
+    uint64 nTransactionOutputs;
+    uint64 nSerializedSize;
+    int64 nTotalAmount;
+
+    CCoinsStatsRange() : fDone(false), fError(false), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+};
+
+/** Worker threads deserialize and reserialize the ranges of a snapshot in
+ *  parallel, while the calling thread hashes them in key order, so the
+ *  result is exactly that of a single pass. Workers run at most a few
+ *  ranges ahead, which bounds the memory used.
+ */
+class CCoinsStatsJob
+{
+private:
+    CLevelDB &db;
+    const leveldb::Snapshot *psnapshot;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<CCoinsStatsRange> vRanges;
+    unsigned int nNext;   // next range to hand out to a worker
+    unsigned int nHashed; // ranges already hashed by the caller
+    unsigned int nWindow; // how many ranges workers may run ahead
+    bool fAbort;
+
+    void Process(unsigned char chRange, CCoinsStatsRange &range)
+    {
+        range.pss.reset(new CDataStream(SER_GETHASH, PROTOCOL_VERSION));
+        CDataStream &ss = *range.pss;
+        const char pchStart[2] = {'o', (char)chRange};
+        leveldb::Iterator *pcursor = db.NewIterator(psnapshot);
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            pcursor->Seek(leveldb::Slice(pchStart, 2));
+            while (pcursor->Valid()) {
+                leveldb::Slice slKey = pcursor->key();
+                if (slKey.size() < 2 || slKey[0] != 'o' || (unsigned char)slKey[1] != chRange)
+                    break;
+                if (slKey.size() == COINS_TX_KEY_SIZE) {
+                    // Transaction record; the outputs follow
+                    pcursor->Next();
+                    continue;
+                }
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                COutPoint outpoint;
+                ssKey >> chType >> outpoint;
+                // Hash the outputs of each transaction together, as when
+                // they were stored that way
                 CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
+                uint256 txhash = outpoint.hash;
+                if (!ReadCoinsOutputs(pcursor, txhash, coins, &range.nSerializedSize)) {
+                    range.fError = true;
+                    break;
+                }
                 ss << txhash;
                 ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
+                ss << (coins.fCoinBase ? 'c' : 'n');
                 ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
+                range.nTransactions++;
                 for (unsigned int i=0; i<coins.vout.size(); i++) {
                     const CTxOut &out = coins.vout[i];
                     if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
+                        range.nTransactionOutputs++;
                         ss << VARINT(i+1);
                         ss << out;
-                        nTotalAmount += out.nValue;
+                        range.nTotalAmount += out.nValue;
                     }
                 }
-                stats.nSerializedSize += 32 + slValue.size();
                 ss << VARINT(0);
             }
-            pcursor->Next();
         } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            range.fError = true;
         }
+        delete pcursor;
+    }
+
+    void Worker()
+    {
+        while (true) {
+            unsigned int nRange;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && nNext < vRanges.size() && nNext >= nHashed + nWindow)
+                    cond.wait(lock);
+                if (fAbort || nNext == vRanges.size())
+                    return;
+                nRange = nNext++;
+            }
+            // Nobody else touches this range until it is marked done
+            Process(nRange, vRanges[nRange]);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                vRanges[nRange].fDone = true;
+            }
+            cond.notify_all();
+        }
+    }
+
+    void Abort(boost::thread_group &threadGroup)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAbort = true;
+        }
+        cond.notify_all();
+        threadGroup.join_all();
+    }
+
+public:
+    CCoinsStatsJob(CLevelDB &dbIn, const leveldb::Snapshot *psnapshotIn) :
+        db(dbIn), psnapshot(psnapshotIn), vRanges(256), nNext(0), nHashed(0), nWindow(0), fAbort(false) {}
+
+    // Add the coins to ss and stats; false on a deserialization error
+    bool Run(CHashWriter &ss, CCoinsStats &stats, int nThreads)
+    {
+        nWindow = 2 * nThreads;
+        boost::thread_group threadGroup;
+        try {
+            for (int i = 0; i < nThreads; i++)
+                threadGroup.create_thread(boost::bind(&CCoinsStatsJob::Worker, this));
+            for (unsigned int i = 0; i < vRanges.size(); i++) {
+                CCoinsStatsRange &range = vRanges[i];
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (!range.fDone)
+                        cond.wait(lock);
+                }
+                if (range.fError) {
+                    Abort(threadGroup);
+                    return false;
+                }
+                if (!range.pss->empty())
+                    ss.write(&(*range.pss)[0], range.pss->size());
+                range.pss.reset();
+                stats.nTransactions += range.nTransactions;
+                stats.nTransactionOutputs += range.nTransactionOutputs;
+                stats.nSerializedSize += range.nSerializedSize;
+                stats.nTotalAmount += range.nTotalAmount;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    nHashed++;
+                }
+                cond.notify_all();
+            }
+        } catch (...) {
+            // Interrupted; the workers use this object, so stop them first
+            Abort(threadGroup);
+            throw;
+        }
+        threadGroup.join_all();
+        return true;
+    }
+};
+
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    // Everything is read from one snapshot, so neither cs_main nor writes to
+    // the database during the scan can make the result inconsistent
+    const leveldb::Snapshot *psnapshot = db.GetSnapshot();
+
+    uint256 hashBestChain = 0;
+    leveldb::Iterator *pcursor = db.NewIterator(psnapshot);
+    pcursor->Seek(leveldb::Slice("H", 1));
+    if (pcursor->Valid() && pcursor->key() == leveldb::Slice("H", 1)) {
+        leveldb::Slice slValue = pcursor->value();
+        if (slValue.size() == sizeof(hashBestChain))
+            memcpy(hashBestChain.begin(), slValue.data(), sizeof(hashBestChain));
     }
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.hashBlock = hashBestChain;
+    ss << stats.hashBlock;
+
+    // As many threads as -par allows for script checks; 0 means none extra
+    int nThreads = std::max(1, nScriptCheckThreads);
+    bool fOk = false;
+    try {
+        fOk = CCoinsStatsJob(db, psnapshot).Run(ss, stats, nThreads);
+    } catch (...) {
+        db.ReleaseSnapshot(psnapshot);
+        throw;
+    }
+    db.ReleaseSnapshot(psnapshot);
+    if (!fOk)
+        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
+        stats.nHeight = (it == mapBlockIndex.end()) ? 0 : it->second->nHeight;
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
+// The snapshot of the block index written at shutdown is only valid as
+// long as its id is recorded here; it is synced, as the file is.
+bool CBlockTreeDB::ReadIndexSnapshot(uint256 &hashSnapshot) {
+    return Read('S', hashSnapshot);
+}
+
+bool CBlockTreeDB::WriteIndexSnapshot(const uint256 &hashSnapshot) {
+    return Write('S', hashSnapshot, true);
+}
+
+bool CBlockTreeDB::EraseIndexSnapshot() {
+    return Erase('S', true);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
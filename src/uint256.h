@@ -587,6 +587,55 @@ public:
         else
             *this = 0;
     }
+
+    // Cheap salted hash for use in hash tables (Bob Jenkins' lookup3 mixing).
+    // Not cryptographic; the salt only prevents attackers from predicting bucket collisions.
+    uint64 GetHash(const uint256& salt) const
+    {
+        uint32_t a, b, c;
+        a = b = c = 0xdeadbeef + (WIDTH << 2);
+
+        a += pn[0] ^ salt.pn[0];
+        b += pn[1] ^ salt.pn[1];
+        c += pn[2] ^ salt.pn[2];
+        HashMix(a, b, c);
+        a += pn[3] ^ salt.pn[3];
+        b += pn[4] ^ salt.pn[4];
+        c += pn[5] ^ salt.pn[5];
+        HashMix(a, b, c);
+        a += pn[6] ^ salt.pn[6];
+        b += pn[7] ^ salt.pn[7];
+        HashFinal(a, b, c);
+
+        return ((((uint64)b) << 32) | c);
+    }
+
+private:
+    static inline uint32_t HashRot(uint32_t x, int k)
+    {
+        return (x << k) | (x >> (32 - k));
+    }
+
+    static inline void HashMix(uint32_t& a, uint32_t& b, uint32_t& c)
+    {
+        a -= c; a ^= HashRot(c, 4);  c += b;
+        b -= a; b ^= HashRot(a, 6);  a += c;
+        c -= b; c ^= HashRot(b, 8);  b += a;
+        a -= c; a ^= HashRot(c, 16); c += b;
+        b -= a; b ^= HashRot(a, 19); a += c;
+        c -= b; c ^= HashRot(b, 4);  b += a;
+    }
+
+    static inline void HashFinal(uint32_t& a, uint32_t& b, uint32_t& c)
+    {
+        c ^= b; c -= HashRot(b, 14);
+        a ^= c; a -= HashRot(c, 11);
+        b ^= a; b -= HashRot(a, 25);
+        c ^= b; c -= HashRot(b, 16);
+        a ^= c; a -= HashRot(c, 4);
+        b ^= a; b -= HashRot(a, 14);
+        c ^= b; c -= HashRot(b, 24);
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }